@@ -0,0 +1,126 @@
+// See LICENSE for license details.
+
+#include "async_file.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <zlib.h>
+
+class async_file_t
+{
+ public:
+  async_file_t(FILE* f, gzFile gz)
+    : f(f), gz(gz), head(0), tail(0), closing(false), error(false)
+  {
+    writer = std::thread(&async_file_t::run, this);
+  }
+
+  // Called on the producer (simulation) thread only.
+  void push(const char* buf, size_t size)
+  {
+    while (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) == ring_size)
+      sched_yield();
+    size_t h = head.load(std::memory_order_relaxed);
+    ring[h % ring_size] = new std::vector<char>(buf, buf + size);
+    {
+      // Taking the lock orders the store before the writer's check, so the
+      // wakeup can't be missed; pushes are 1 MiB apart, so it's cheap
+      std::lock_guard<std::mutex> lock(mutex);
+      head.store(h + 1, std::memory_order_release);
+    }
+    wake.notify_one();
+  }
+
+  // Returns false if any write, or closing the file, failed
+  bool close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closing.store(true, std::memory_order_release);
+    }
+    wake.notify_one();
+    writer.join();
+    if (gz ? gzclose(gz) != Z_OK : fclose(f) != 0)
+      error = true;
+    return !error;
+  }
+
+ private:
+  static const size_t ring_size = 64;
+
+  void run()
+  {
+    while (true)
+    {
+      size_t t = tail.load(std::memory_order_relaxed);
+      if (t == head.load(std::memory_order_acquire))
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] {
+          return t != head.load(std::memory_order_acquire) || closing.load(std::memory_order_acquire);
+        });
+        if (t == head.load(std::memory_order_acquire))
+          return;
+        continue;
+      }
+
+      std::vector<char>* chunk = ring[t % ring_size];
+      tail.store(t + 1, std::memory_order_release);
+      // After a failure the rest is drained unwritten; the file is already
+      // incomplete and close() reports it
+      if (!error)
+      {
+        size_t written = gz ? gzwrite(gz, &(*chunk)[0], chunk->size())
+                            : fwrite(&(*chunk)[0], 1, chunk->size(), f);
+        if (written != chunk->size())
+          error = true;
+      }
+      delete chunk;
+    }
+  }
+
+  FILE* f;
+  gzFile gz;
+  std::vector<char>* ring[ring_size];
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+  std::atomic<bool> closing;
+  bool error;          // sticky; written by the writer, read after join()
+  std::mutex mutex;    // only for sleeping on wake
+  std::condition_variable wake;
+  std::thread writer;
+};
+
+static ssize_t async_file_write(void* cookie, const char* buf, size_t size)
+{
+  static_cast<async_file_t*>(cookie)->push(buf, size);
+  return size;
+}
+
+static int async_file_close(void* cookie)
+{
+  async_file_t* af = static_cast<async_file_t*>(cookie);
+  bool ok = af->close();
+  delete af;
+  return ok ? 0 : EOF;
+}
+
+FILE* async_fopen(const char* fn, bool gzip)
+{
+  FILE* f = NULL;
+  gzFile gz = NULL;
+  if (gzip)
+    gz = gzopen(fn, "wb1"); // favour speed: waveforms compress well anyway
+  else
+    f = fopen(fn, "w");
+  if (!f && !gz)
+    return NULL;
+
+  cookie_io_functions_t io = {NULL, async_file_write, NULL, async_file_close};
+  FILE* stream = fopencookie(new async_file_t(f, gz), "w", io);
+  setvbuf(stream, NULL, _IOFBF, 1 << 20);
+  return stream;
+}
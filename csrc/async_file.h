@@ -0,0 +1,16 @@
+// See LICENSE for license details.
+
+#ifndef _ASYNC_FILE_H
+#define _ASYNC_FILE_H
+
+#include <stdio.h>
+
+// Opens fn for writing as a stdio stream whose output is buffered in large
+// chunks and handed through a lock-free queue to a background thread, which
+// does the actual writes (gzip-compressing them if gzip is set).  The
+// calling thread only ever blocks if the writer falls a long way behind.
+// fclose() drains the queue, waits for the writer, and returns EOF if any
+// write or the final close failed.  Returns NULL if fn can't be opened.
+FILE* async_fopen(const char* fn, bool gzip);
+
+#endif
@@ -0,0 +1,184 @@
+// See LICENSE for license details.
+
+#include "axi_trace.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+axi_trace_writer_t::axi_trace_writer_t(FILE* f, int nchannels, size_t word_size,
+                                       size_t line_size, uint64_t mem_size)
+  : f(f), word_size(word_size), last_cycle(0)
+{
+  assert(nchannels <= 32);
+  axi_trace_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, axi_trace_magic, sizeof(hdr.magic));
+  hdr.nchannels = nchannels;
+  hdr.word_size = word_size;
+  hdr.line_size = line_size;
+  hdr.mem_size = mem_size;
+  fwrite(&hdr, sizeof(hdr), 1, f);
+}
+
+axi_trace_writer_t::~axi_trace_writer_t()
+{
+  fclose(f);
+}
+
+void axi_trace_writer_t::put_varint(uint64_t x)
+{
+  for (; x >= 0x80; x >>= 7)
+    putc_unlocked(0x80 | (x & 0x7f), f);
+  putc_unlocked(x, f);
+}
+
+void axi_trace_writer_t::put_tag(axi_trace_kind_t kind, int channel, uint64_t cycle)
+{
+  putc_unlocked(kind | channel << 3, f);
+  put_varint(cycle - last_cycle);
+  last_cycle = cycle;
+}
+
+void axi_trace_writer_t::record(uint64_t cycle, int channel, const mm_port_in_t& in,
+                                const mm_port_out_t& out)
+{
+  if (in.ar_valid && out.ar_ready)
+  {
+    put_tag(AXI_AR, channel, cycle);
+    put_varint(in.ar_addr);
+    put_varint(in.ar_id);
+    putc_unlocked(in.ar_size, f);
+    putc_unlocked(in.ar_len, f);
+  }
+  if (in.aw_valid && out.aw_ready)
+  {
+    put_tag(AXI_AW, channel, cycle);
+    put_varint(in.aw_addr);
+    put_varint(in.aw_id);
+    putc_unlocked(in.aw_size, f);
+    putc_unlocked(in.aw_len, f);
+  }
+  if (in.w_valid && out.w_ready)
+  {
+    put_tag(AXI_W, channel, cycle);
+    put_varint(in.w_strb);
+    putc_unlocked(in.w_last, f);
+    fwrite(in.w_data, word_size, 1, f);
+  }
+  if (out.r_valid && in.r_ready)
+  {
+    put_tag(AXI_R, channel, cycle);
+    put_varint(out.r_id);
+    putc_unlocked(out.r_last, f);
+  }
+  if (out.b_valid && in.b_ready)
+  {
+    put_tag(AXI_B, channel, cycle);
+    put_varint(out.b_id);
+  }
+}
+
+axi_trace_reader_t::axi_trace_reader_t(const char* fn)
+  : fn(fn), base(NULL), size(0), pos(sizeof(axi_trace_header_t)), cycle(0)
+{
+  int fd = open(fn, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    fprintf(stderr, "could not open %s\n", fn);
+    exit(-1);
+  }
+  size = st.st_size;
+  void* p = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED || size < sizeof(axi_trace_header_t) ||
+      memcmp(p, axi_trace_magic, sizeof(axi_trace_magic)) != 0)
+  {
+    fprintf(stderr, "%s is not an AXI trace\n", fn);
+    exit(-1);
+  }
+  madvise(p, size, MADV_SEQUENTIAL);
+  base = (const uint8_t*)p;
+}
+
+axi_trace_reader_t::~axi_trace_reader_t()
+{
+  munmap((void*)base, size);
+}
+
+uint8_t axi_trace_reader_t::get_byte()
+{
+  if (pos >= size)
+  {
+    fprintf(stderr, "%s: truncated record at offset %ld\n", fn, pos);
+    exit(-1);
+  }
+  return base[pos++];
+}
+
+uint64_t axi_trace_reader_t::get_varint()
+{
+  size_t start = pos;
+  uint64_t x = 0;
+  for (int shift = 0; ; shift += 7)
+  {
+    uint8_t b = get_byte();
+    // a 64-bit value takes at most 10 bytes, the last holding only bit 63
+    if (shift == 63 && (b & 0xfe))
+    {
+      fprintf(stderr, "%s: corrupt varint at offset %ld\n", fn, start);
+      exit(-1);
+    }
+    x |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return x;
+  }
+}
+
+bool axi_trace_reader_t::next(axi_trace_event_t* e)
+{
+  if (pos == size)
+    return false;
+
+  uint8_t tag = get_byte();
+  e->kind = axi_trace_kind_t(tag & 7);
+  e->channel = tag >> 3;
+  e->cycle = cycle += get_varint();
+  e->data = NULL;
+  switch (e->kind)
+  {
+    case AXI_AR:
+    case AXI_AW:
+      e->addr = get_varint();
+      e->id = get_varint();
+      e->size = get_byte();
+      e->len = get_byte();
+      break;
+    case AXI_W:
+      e->strb = get_varint();
+      e->last = get_byte();
+      if (size - pos < header().word_size)
+      {
+        fprintf(stderr, "%s: truncated record at offset %ld\n", fn, pos);
+        exit(-1);
+      }
+      e->data = base + pos;
+      pos += header().word_size;
+      break;
+    case AXI_R:
+      e->id = get_varint();
+      e->last = get_byte();
+      break;
+    case AXI_B:
+      e->id = get_varint();
+      break;
+    default:
+      fprintf(stderr, "%s: bad record at offset %ld\n", fn, pos - 1);
+      exit(-1);
+  }
+  return true;
+}
@@ -0,0 +1,95 @@
+// See LICENSE for license details.
+
+#ifndef _AXI_TRACE_H
+#define _AXI_TRACE_H
+
+#include "mm.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary traces of the AXI handshakes on every memory channel, as recorded
+// by the emulator with +axi-trace=<file> and replayed into a memory model on
+// its own by mm_replay.
+//
+// A trace is an axi_trace_header_t, then one record per handshake in cycle
+// order.  A record starts with a tag byte (the kind in bits 2:0, the channel
+// in bits 7:3) and the cycles since the previous record as a LEB128 varint,
+// followed by
+//   AR, AW: addr, id (varints), size, len (bytes)
+//   W:      strb (varint), last (byte), word_size bytes of data
+//   R:      id (varint), last (byte)
+//   B:      id (varint)
+// Addresses are channel-relative, as the models see them.
+
+static const char axi_trace_magic[8] = {'R', 'A', 'X', 'I', 'T', 'R', '1', '\n'};
+
+struct axi_trace_header_t
+{
+  char magic[8];
+  uint32_t nchannels;
+  uint32_t word_size;
+  uint32_t line_size;
+  uint32_t reserved;
+  uint64_t mem_size;   // per channel
+};
+
+enum axi_trace_kind_t { AXI_AR, AXI_AW, AXI_W, AXI_R, AXI_B };
+
+struct axi_trace_event_t
+{
+  axi_trace_kind_t kind;
+  int channel;
+  uint64_t cycle;
+  uint64_t addr;
+  uint64_t id;
+  uint64_t size;
+  uint64_t len;
+  uint64_t strb;
+  bool last;
+  const uint8_t* data;  // W only; points into the reader's mapping
+};
+
+class axi_trace_writer_t
+{
+ public:
+  // Takes ownership of f and closes it when destroyed
+  axi_trace_writer_t(FILE* f, int nchannels, size_t word_size, size_t line_size,
+                     uint64_t mem_size);
+  ~axi_trace_writer_t();
+
+  // Record the handshakes on one channel during one cycle
+  void record(uint64_t cycle, int channel, const mm_port_in_t& in, const mm_port_out_t& out);
+
+ private:
+  void put_tag(axi_trace_kind_t kind, int channel, uint64_t cycle);
+  void put_varint(uint64_t x);
+
+  FILE* f;
+  size_t word_size;
+  uint64_t last_cycle;
+};
+
+class axi_trace_reader_t
+{
+ public:
+  // Maps fn; exits if it can't be read or isn't a trace
+  axi_trace_reader_t(const char* fn);
+  ~axi_trace_reader_t();
+
+  const axi_trace_header_t& header() const { return *(const axi_trace_header_t*)base; }
+
+  // Decode the next record; false at the end of the trace
+  bool next(axi_trace_event_t* e);
+
+ private:
+  uint64_t get_varint();
+  uint8_t get_byte();
+
+  const char* fn;
+  const uint8_t* base;
+  size_t size;
+  size_t pos;
+  uint64_t cycle;
+};
+
+#endif
@@ -0,0 +1,46 @@
+// See LICENSE for license details.
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Helpers for reading and writing emulator checkpoints.  Checkpoints are
+// only ever restored by the same emulator binary, so state is written in
+// host byte order and layout.
+
+static inline void ckpt_write(FILE* f, const void* p, size_t n)
+{
+  if (n && fwrite(p, n, 1, f) != 1)
+  {
+    fprintf(stderr, "error writing checkpoint\n");
+    exit(-1);
+  }
+}
+
+static inline void ckpt_read(FILE* f, void* p, size_t n)
+{
+  if (n && fread(p, n, 1, f) != 1)
+  {
+    fprintf(stderr, "error reading checkpoint (truncated file?)\n");
+    exit(-1);
+  }
+}
+
+template <class T>
+static inline void ckpt_put(FILE* f, const T& x)
+{
+  ckpt_write(f, &x, sizeof(x));
+}
+
+template <class T>
+static inline T ckpt_get(FILE* f)
+{
+  T x;
+  ckpt_read(f, &x, sizeof(x));
+  return x;
+}
+
+#endif
@@ -5,8 +5,20 @@
 // Utility for taking a raw commit log from a processor and post-processing it
 // into a diff-able format against the spike ISA simulator's commit log.
 //
-// INPUT : a raw commit log via std::cin
-// OUTPUT: a cleaned up commit log via std::cout
+// INPUT : a raw commit log via stdin
+// OUTPUT: a cleaned up commit log via stdout
+//
+// USAGE : comlog [-p <npdst>] [-o <prefix>] [-t]
+//    -p  initial size of the pdst table (it grows as larger tags are seen)
+//    -o  demultiplex a multi-core log into per-hart files <prefix>.<hart>
+//    -t  write text even if the input is a binary log
+//
+// BINARY: the input may also be a binary commit log (see commit_log.h), in
+// which case the output is binary too unless -t is given.
+//
+// MULTI-CORE: lines may carry a "C<hart>: " prefix, in which case each hart
+// gets its own reorder buffer.  Without -o, the output stays interleaved and
+// keeps the prefixes; with -o, each hart's log is written without them.
 //
 // PROBLEM: some writebacks can occur after the commit point in a processor.
 // These partial entries will be marked as appropriate, and the writebacks will
@@ -67,162 +79,241 @@
   -----------------------------------------------------------
 */
 
+#include "comlog.h"
+#include "commit_log.h"
 #include <stdio.h>
-#include <iostream>
-#include <array>
-#include <queue>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <string>
 #include <vector>
 
+// The log is processed as a stream: input is read in large chunks and
+// parsed in place, and lines are fed to each hart's ROB without being
+// copied.  Committed lines go to a buffered output.
 
-// Maximum number of physical destination registers, 64 for Rocket
-const int kMaxPdst = 64;
+
+const size_t kChunkSize = 1 << 20;
 
 // data-structures
 
-typedef struct RobEntry
+typedef struct Output
 {
-   bool        ready;               // is entry ready to be committed?
-   int         pdst;                // the wb physical dest. register
-   std::string str;                 // the commit string to print out
-} RobEntry;
+   int               fd;
+   std::vector<char> buf;
+   commit_log_codec_t* codec;       // non-null for binary output
+} Output;
 
-std::deque <RobEntry> rob;
+typedef struct Hart
+{
+   Rob*              rob;
+   Output*           out;
+} Hart;
 
+int npdst = kMaxPdst;
+const char* out_prefix = nullptr;     // demultiplex harts into files
+bool binary_out = false;
 
-// maps from physical destination register to rob entry waiting on it
-//   a value of nullptr implies there is no rob entry waiting on pdst
-std::vector<RobEntry*> pdst_to_rob(kMaxPdst, nullptr);
+Output stdout_output = {STDOUT_FILENO, {}, nullptr};
+std::vector<Hart*> harts;
 
 
 // functions
 
-void push               (std::string& line);
-void commit             ();
-void writeback          (std::string& line);
-bool is_instruction     (std::string& line);
-bool is_partial_commit  (std::string& line);
-int  get_ldst           (std::string& line);
-int  get_pdst           (std::string& line);
-
-// add instruction to the ROB
-// mark as "not ready" if writeback data not ready
-void push (std::string& line)
-{
-   bool is_partial = is_partial_commit(line);
-
-   RobEntry rob_entry;
-   rob_entry.str   = line;
-   rob_entry.ready = !(is_partial);
-   rob_entry.pdst  = is_partial ? get_pdst(line) : 0;
-   rob.push_back(rob_entry);
+Hart& get_hart          (int id);
+void init_output        (Output* out, int fd);
+void emit               (Output* out, const char* str, size_t len);
+void flush_output       (Output* out);
 
-   if (is_partial)
+// buffered output, flushed in large writes
+void emit (Output* out, const char* str, size_t len)
+{
+   if (out->codec)
    {
-      assert (rob_entry.pdst < kMaxPdst);
-      assert (pdst_to_rob[rob_entry.pdst] == nullptr);
-      pdst_to_rob[rob_entry.pdst] = &(rob.back());
+      out->codec->encode_line(str, len, &out->buf);
    }
+   else
+   {
+      out->buf.insert(out->buf.end(), str, str + len);
+      out->buf.push_back('\n');
+   }
+   if (out->buf.size() >= kChunkSize)
+      flush_output(out);
 }
 
-void commit ()
+void init_output (Output* out, int fd)
 {
-   while (!rob.empty() && rob.front().ready)
+   out->fd = fd;
+   out->codec = nullptr;
+   if (binary_out)
    {
-      std::cout << rob.front().str << std::endl;
-      rob.pop_front();
+      out->codec = new commit_log_codec_t;
+      out->buf.insert(out->buf.end(), commit_log_magic, commit_log_magic + sizeof(commit_log_magic));
    }
 }
 
-int get_ldst (std::string& line)
+void flush_output (Output* out)
 {
-   assert (line.length() > 46);
-
-   int idx = line.find_first_of('x');
-   int dst = atoi(line.substr(idx+1,2).c_str());
-   return dst;
+   size_t done = 0;
+   while (done < out->buf.size())
+   {
+      ssize_t n = write(out->fd, &out->buf[done], out->buf.size() - done);
+      assert (n > 0);
+      done += n;
+   }
+   out->buf.clear();
 }
 
-int get_pdst (std::string& line)
+Hart& get_hart (int id)
 {
-   assert (line.length() > 46);
+   assert (id >= 0);
+   if (size_t(id) >= harts.size())
+      harts.resize(id+1, nullptr);
 
-   int idx = line.find_first_of('p');
-   int dst = atoi(line.substr(idx+1,2).c_str());
-   return dst;
-}
+   if (harts[id] == nullptr)
+   {
+      Hart* hart = new Hart;
+      hart->out = &stdout_output;
+      if (out_prefix)
+      {
+         std::string fn = std::string(out_prefix) + "." + std::to_string(id);
+         int fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+         if (fd < 0)
+         {
+            fprintf(stderr, "comlog: could not open %s\n", fn.c_str());
+            exit(1);
+         }
+         hart->out = new Output;
+         init_output(hart->out, fd);
+      }
 
-bool is_partial_commit (std::string& line)
-{
-   if (line.length() > 46 && (line.at(34) == 'x' || line.at(34) == 'f') && line.at(46) == 'X')
-      return true;
-   else
-      return false;
+      // with -o, each hart's file is written without the hart prefix
+      Output* out = hart->out;
+      bool strip = out_prefix != nullptr;
+      hart->rob = new Rob(npdst, [out, strip](const char* str, size_t len, size_t prefix) {
+         size_t skip = strip ? prefix : 0;
+         emit(out, str + skip, len - skip);
+      });
+      harts[id] = hart;
+   }
+   return *harts[id];
 }
 
-bool is_instruction (std::string& line)
+void process (const char* str, size_t len)
 {
-   return !(line.at(0) == 'x' || line.at(0) == 'f');
+   Line line = make_line(str, len);
+   get_hart(line.hart).rob->process(line);
 }
 
-// find instruction in ROB and substitute in the writeback data
-// and mark it as ready for commit
-void writeback (std::string& line)
+void flush_all ()
 {
-   assert (line.at(0) == 'x' || line.at(0) == 'f');
-
-   size_t idx = line.find_first_of('p');
-   assert (idx != std::string::npos);
-   int pdst = atoi(line.substr(idx+1,2).c_str());
-
-   // search the partial queue for writeback
-   assert (pdst < kMaxPdst);
-   RobEntry* rob_entry = pdst_to_rob[pdst];
-   assert (rob_entry != nullptr);
-   pdst_to_rob[pdst] = nullptr;
-
-   // update ROB
-   assert (rob_entry->str.length() > 32);
-   std::string* rob_str = &(rob_entry->str);
-
-   // mark as ready
-   rob_entry->ready = true;
-   idx = line.find("0x");
-   std::string wbdata = line.substr(idx+2,16);
-   idx = rob_str->find("0x",32); // actually want to find the 3rd occurrence
-   int p_idx = rob_str->find_first_of('p');
-   rob_str->replace(idx+2,16,wbdata);
-   rob_str->erase(p_idx, (idx-p_idx));
+   flush_output(&stdout_output);
+   for (Hart* hart : harts)
+      if (hart && hart->out != &stdout_output)
+         flush_output(hart->out);
 }
 
 int main (int argc, char** argv)
 {
-   std::string line;
+   bool text_only = false;
+   for (int i = 1; i < argc; i++)
+   {
+      std::string arg = argv[i];
+      if (arg == "-p" && i+1 < argc)
+         npdst = atoi(argv[++i]);
+      else if (arg == "-o" && i+1 < argc)
+         out_prefix = argv[++i];
+      else if (arg == "-t")
+         text_only = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-p <npdst>] [-o <prefix>] [-t] < log\n", argv[0]);
+         return 1;
+      }
+   }
 
-   // check for errno
-   while (getline(std::cin, line))
+   std::vector<char> buf(kChunkSize);
+   size_t have = 0;
+   bool first = true;
+   bool binary_in = false;
+   commit_log_codec_t codec;
+   std::string text;
+
+   while (true)
    {
-      if (is_instruction(line))
+      if (have == buf.size())
+         buf.resize(2 * buf.size()); // a line longer than a whole chunk
+
+      ssize_t n = read(STDIN_FILENO, &buf[have], buf.size() - have);
+      if (n < 0)
       {
-         push(line);
+         // IO error
+         flush_all();
+         printf("\nIO ERROR: read() failed\n\n");
+         return 1;
+      }
+      if (n == 0 && !first)
+         break;
+      have += n;
+
+      size_t start = 0;
+      if (first)
+      {
+         // wait for enough input to tell a binary log from a text one
+         if (n != 0 && have < sizeof(commit_log_magic))
+            continue;
+         first = false;
+         binary_in = commit_log_is_binary(&buf[0], have);
+         binary_out = binary_in && !text_only;
+         if (!out_prefix)
+            init_output(&stdout_output, STDOUT_FILENO);
+         if (binary_in)
+            start = sizeof(commit_log_magic);
+      }
+
+      if (binary_in)
+      {
+         // render each record as text for the ROB
+         commit_rec_t rec;
+         while (size_t len = codec.decode(&buf[start], have - start, &rec))
+         {
+            text.clear();
+            commit_rec_format(rec, &text);
+            process(text.data(), text.size());
+            start += len;
+         }
       }
       else
       {
-         writeback(line);
+         // process every complete line in the buffer
+         for (ssize_t nl; (nl = find_char(&buf[0], have, '\n', start)) >= 0; start = nl + 1)
+            process(&buf[start], nl - start);
       }
 
-      // check if head of the rob is ready, commit
-      // instructions until either empty or not ready
-      commit();
+      // carry over the partial line at the end
+      memmove(&buf[0], &buf[start], have - start);
+      have -= start;
+      if (n == 0)
+         break;
    }
 
-   if (std::cin.bad())
+   // a final line without a newline
+   if (have > 0)
    {
-      // IO error
-      std::cout << "\nIO ERROR: cin.bad()\n\n";
-      return 1;
+      if (binary_in)
+      {
+         flush_all();
+         fprintf(stderr, "comlog: truncated record at end of log\n");
+         return 1;
+      }
+      process(&buf[0], have);
    }
 
+   flush_all();
+   for (Hart* hart : harts)
+      if (hart && hart->out != &stdout_output)
+         close(hart->out->fd);
    return 0;
 }
-
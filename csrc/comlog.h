@@ -0,0 +1,248 @@
+// See LICENSE for license details.
+
+#ifndef _COMLOG_H
+#define _COMLOG_H
+
+// The reorder buffer behind comlog: it puts late writebacks back into their
+// partial commit entries (see comlog.cc for the log format).  It is kept in
+// a header so the emulator's +cosim checker can reorder commits in-process.
+//
+// Lines that commit straight away (the vast majority) are handed to the emit
+// callback as they arrive.  Only lines that must wait on an earlier partial
+// commit are copied, into an arena that is recycled whenever the ROB drains.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <vector>
+
+
+// Default number of physical destination registers, 64 for Rocket
+const int kMaxPdst = 64;
+
+// data-structures
+
+// a view of one line of text, without its newline
+typedef struct Line
+{
+   const char* str;
+   size_t      len;
+   size_t      prefix;              // length of the "C<hart>: " prefix
+   int         hart;
+} Line;
+
+typedef struct RobEntry
+{
+   bool        ready;               // is entry ready to be committed?
+   int         pdst;                // the wb physical dest. register
+   size_t      offset;              // the commit string to print out,
+   size_t      len;                 //   stored in the arena
+   size_t      prefix;
+} RobEntry;
+
+
+// helpers
+
+// returns the first occurrence of c in str[from, len), or -1
+static inline ssize_t find_char (const char* str, size_t len, char c, size_t from = 0)
+{
+   if (from >= len)
+      return -1;
+   const char* p = (const char*) memchr(str + from, c, len - from);
+   return p ? p - str : -1;
+}
+
+// returns the first occurrence of "0x" in str[from, len), or -1
+static inline ssize_t find_hex (const char* str, size_t len, size_t from = 0)
+{
+   for (ssize_t i = find_char(str, len, '0', from); i >= 0; i = find_char(str, len, '0', i+1))
+      if (size_t(i+1) < len && str[i+1] == 'x')
+         return i;
+   return -1;
+}
+
+// split off the optional "C<hart>: " prefix
+static inline Line make_line (const char* str, size_t len)
+{
+   Line line = {str, len, 0, 0};
+   if (len > 0 && str[0] == 'C')
+   {
+      size_t i = 1;
+      int hart = 0;
+      while (i < len && str[i] >= '0' && str[i] <= '9')
+         hart = hart * 10 + (str[i++] - '0');
+      assert (i > 1 && i+1 < len && str[i] == ':' && str[i+1] == ' ');
+      line.hart = hart;
+      line.prefix = i+2;
+   }
+   return line;
+}
+
+// the pdst follows the first 'p' on the line, right-aligned in a field that
+// is at least 2 characters wide
+static inline int get_pdst (const char* str, size_t len)
+{
+   ssize_t idx = find_char(str, len, 'p');
+   assert (idx >= 0);
+   size_t i = idx+1;
+   while (i < len && str[i] == ' ')
+      i++;
+   assert (i < len && str[i] >= '0' && str[i] <= '9');
+   int pdst = 0;
+   while (i < len && str[i] >= '0' && str[i] <= '9')
+      pdst = pdst * 10 + (str[i++] - '0');
+   return pdst;
+}
+
+static inline bool is_partial_commit (const Line& line)
+{
+   const char* s = line.str + line.prefix;
+   size_t len = line.len - line.prefix;
+   return len > 46 && (s[34] == 'x' || s[34] == 'f') && s[46] == 'X';
+}
+
+static inline bool is_instruction (const Line& line)
+{
+   const char* s = line.str + line.prefix;
+   return !(line.len > line.prefix && (s[0] == 'x' || s[0] == 'f'));
+}
+
+
+// one hart's reorder buffer; lines are emitted in commit order, along with
+// the length of their hart prefix
+class Rob
+{
+ public:
+   typedef std::function<void(const char* str, size_t len, size_t prefix)> EmitFn;
+
+   Rob (int npdst, EmitFn emit) : pdst_to_rob(npdst, nullptr), arena_used(0), emit(emit) {}
+
+   bool empty () const { return rob.empty(); }
+
+   // at the end of the log: emit everything left, in order, including
+   // instructions still waiting for their writeback
+   void flush ()
+   {
+      for (RobEntry& e : rob)
+         emit(&arena[e.offset], e.len, e.prefix);
+      rob.clear();
+      std::fill(pdst_to_rob.begin(), pdst_to_rob.end(), nullptr);
+   }
+
+   void process (const Line& line)
+   {
+      if (is_instruction(line))
+      {
+         push(line);
+      }
+      else
+      {
+         writeback(line);
+      }
+
+      // check if head of the rob is ready, commit
+      // instructions until either empty or not ready
+      commit();
+   }
+
+ private:
+   // add instruction to the ROB
+   // mark as "not ready" if writeback data not ready
+   void push (const Line& line)
+   {
+      bool is_partial = is_partial_commit(line);
+
+      // nothing to wait for: commit it straight away
+      if (!is_partial && rob.empty())
+      {
+         emit(line.str, line.len, line.prefix);
+         return;
+      }
+
+      if (rob.empty())
+         arena_used = 0;
+      if (arena_used + line.len > arena.size())
+         arena.resize(std::max(2 * arena.size(), arena_used + line.len));
+      memcpy(&arena[arena_used], line.str, line.len);
+
+      RobEntry rob_entry;
+      rob_entry.offset = arena_used;
+      rob_entry.len    = line.len;
+      rob_entry.prefix = line.prefix;
+      rob_entry.ready  = !(is_partial);
+      rob_entry.pdst   = is_partial ? get_pdst(line.str + line.prefix, line.len - line.prefix) : 0;
+      rob.push_back(rob_entry);
+      arena_used += line.len;
+
+      if (is_partial)
+      {
+         if (size_t(rob_entry.pdst) >= pdst_to_rob.size())
+            pdst_to_rob.resize(rob_entry.pdst+1, nullptr);
+         assert (pdst_to_rob[rob_entry.pdst] == nullptr);
+         pdst_to_rob[rob_entry.pdst] = &(rob.back());
+      }
+   }
+
+   void commit ()
+   {
+      while (!rob.empty() && rob.front().ready)
+      {
+         RobEntry& e = rob.front();
+         emit(&arena[e.offset], e.len, e.prefix);
+         rob.pop_front();
+      }
+   }
+
+   // find instruction in ROB and substitute in the writeback data
+   // and mark it as ready for commit
+   void writeback (const Line& line)
+   {
+      const char* str = line.str + line.prefix;
+      size_t len = line.len - line.prefix;
+      assert (str[0] == 'x' || str[0] == 'f');
+
+      int pdst = get_pdst(str, len);
+
+      // search the partial queue for writeback
+      assert (size_t(pdst) < pdst_to_rob.size());
+      RobEntry* rob_entry = pdst_to_rob[pdst];
+      assert (rob_entry != nullptr);
+      pdst_to_rob[pdst] = nullptr;
+
+      // update ROB
+      char* rob_str = &arena[rob_entry->offset + rob_entry->prefix];
+      size_t rob_len = rob_entry->len - rob_entry->prefix;
+      assert (rob_len > 32);
+
+      // mark as ready
+      rob_entry->ready = true;
+      ssize_t idx = find_hex(str, len);
+      assert (idx >= 0 && size_t(idx+18) <= len);
+      const char* wbdata = str + idx + 2;
+      idx = find_hex(rob_str, rob_len, 32); // actually want to find the 3rd occurrence
+      ssize_t p_idx = find_char(rob_str, rob_len, 'p');
+      assert (idx >= 0 && p_idx >= 0 && p_idx <= idx && size_t(idx+18) <= rob_len);
+
+      // splice in the data, and drop the pdst tag in front of it
+      memcpy(rob_str + idx + 2, wbdata, 16);
+      memmove(rob_str + p_idx, rob_str + idx, rob_len - idx);
+      rob_entry->len -= idx - p_idx;
+   }
+
+   std::deque <RobEntry> rob;
+
+   // maps from physical destination register to rob entry waiting on it
+   //   a value of nullptr implies there is no rob entry waiting on pdst
+   std::vector<RobEntry*> pdst_to_rob;
+
+   std::vector<char> arena;
+   size_t arena_used;
+
+   EmitFn emit;
+};
+
+#endif
@@ -0,0 +1,357 @@
+// See LICENSE for license details.
+
+#ifndef _COMMIT_LOG_H
+#define _COMMIT_LOG_H
+
+// A compact binary encoding of the commit log text that comlog and float_fix
+// work on (see comlog.cc for the text format).  A binary log starts with
+// commit_log_magic, followed by one variable-length record per line:
+//
+//   tag       1 byte   [1:0] priv, [4:2] kind, [5] hart present,
+//                      [6] pc is the hart's previous pc + 4, [7] fp rd
+//   hart      2 bytes  if tag[5]
+//   pc        8 bytes  instructions, unless tag[6]
+//   insn      4 bytes  instructions
+//   rd        1 byte   kinds with a destination
+//   pdst      2 bytes  partial commits and writebacks
+//   data      8 bytes  kinds with writeback data
+//
+// Multi-byte fields are little-endian.  A line that isn't in the canonical
+// text format is kept verbatim as a text record (a 4-byte length and the
+// bytes), so decoding and rendering always gives back the original text.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const char commit_log_magic[8] = {'R', 'V', 'C', 'L', 'O', 'G', '1', '\n'};
+
+enum commit_kind_t
+{
+  COMMIT_INSN,          // an instruction without a destination
+  COMMIT_INSN_RD,       // an instruction and its writeback
+  COMMIT_PARTIAL,       // an instruction whose writeback comes later
+  COMMIT_WRITEBACK,     // the late writeback of a partial commit
+  COMMIT_TEXT           // anything else, verbatim
+};
+
+struct commit_rec_t
+{
+  commit_kind_t kind;
+  uint8_t priv;
+  bool has_hart;
+  uint16_t hart;
+  bool fp;              // rd is an f register
+  uint8_t rd;
+  uint16_t pdst;
+  uint32_t insn;
+  uint64_t pc;
+  uint64_t data;
+  const char* text;     // COMMIT_TEXT only; points into the source buffer
+  size_t text_len;
+};
+
+static inline bool commit_log_is_binary(const char* buf, size_t len)
+{
+  return len >= sizeof(commit_log_magic) &&
+         memcmp(buf, commit_log_magic, sizeof(commit_log_magic)) == 0;
+}
+
+// Renders rec in the text format, appending it (without a newline) to out
+static inline void commit_rec_format(const commit_rec_t& rec, std::string* out)
+{
+  if (rec.kind == COMMIT_TEXT)
+  {
+    out->append(rec.text, rec.text_len);
+    return;
+  }
+
+  char buf[128];
+  int n = 0;
+  char rd = rec.fp ? 'f' : 'x';
+  if (rec.has_hart)
+    n += sprintf(buf + n, "C%d: ", rec.hart);
+  if (rec.kind == COMMIT_WRITEBACK)
+  {
+    n += sprintf(buf + n, "%c%2d p%2d 0x%016llx", rd, rec.rd, rec.pdst,
+                 (unsigned long long)rec.data);
+  }
+  else
+  {
+    n += sprintf(buf + n, "%d 0x%016llx (0x%08x)", rec.priv,
+                 (unsigned long long)rec.pc, rec.insn);
+    if (rec.kind == COMMIT_INSN_RD)
+      n += sprintf(buf + n, " %c%2d 0x%016llx", rd, rec.rd,
+                   (unsigned long long)rec.data);
+    else if (rec.kind == COMMIT_PARTIAL)
+      n += sprintf(buf + n, " %c%2d p%2d 0xXXXXXXXXXXXXXXXX", rd, rec.rd, rec.pdst);
+  }
+  out->append(buf, n);
+}
+
+// True if a and b render the same text.  Fields a kind doesn't use are zero
+// in both parsed and decoded records, so they compare equal.
+static inline bool commit_rec_equal(const commit_rec_t& a, const commit_rec_t& b)
+{
+  if (a.kind != b.kind)
+    return false;
+  if (a.kind == COMMIT_TEXT)
+    return a.text_len == b.text_len && memcmp(a.text, b.text, a.text_len) == 0;
+  return a.priv == b.priv && a.has_hart == b.has_hart && a.hart == b.hart &&
+         a.fp == b.fp && a.rd == b.rd && a.pdst == b.pdst && a.insn == b.insn &&
+         a.pc == b.pc && a.data == b.data;
+}
+
+// A bounded cursor for parsing a line that isn't NUL-terminated
+struct commit_line_parser_t
+{
+  const char* p;
+  const char* end;
+
+  bool lit(const char* s)
+  {
+    size_t n = strlen(s);
+    if (size_t(end - p) < n || memcmp(p, s, n) != 0)
+      return false;
+    p += n;
+    return true;
+  }
+  bool dec(uint64_t* x)
+  {
+    while (p < end && *p == ' ')
+      p++;
+    const char* start = p;
+    for (*x = 0; p < end && *p >= '0' && *p <= '9'; p++)
+      *x = *x * 10 + (*p - '0');
+    return p != start;
+  }
+  bool hex(uint64_t* x, int digits)
+  {
+    if (end - p < digits)
+      return false;
+    *x = 0;
+    for (int i = 0; i < digits; i++, p++)
+    {
+      char c = *p;
+      int d = c >= '0' && c <= '9' ? c - '0' :
+              c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+      if (d < 0)
+        return false;
+      *x = (*x << 4) | d;
+    }
+    return true;
+  }
+  bool reg(commit_rec_t* rec)
+  {
+    uint64_t rd;
+    if (p == end || (*p != 'x' && *p != 'f'))
+      return false;
+    rec->fp = *p++ == 'f';
+    if (!dec(&rd) || rd > 0xff)
+      return false;
+    rec->rd = rd;
+    return true;
+  }
+  bool pdst(commit_rec_t* rec)
+  {
+    uint64_t pdst;
+    if (!lit(" p") || !dec(&pdst) || pdst > 0xffff)
+      return false;
+    rec->pdst = pdst;
+    return true;
+  }
+};
+
+static inline bool commit_rec_parse_fields(const char* str, size_t len, commit_rec_t* rec)
+{
+  commit_line_parser_t in = {str, str + len};
+  uint64_t x;
+
+  rec->has_hart = false;
+  rec->hart = 0;
+  rec->priv = 0;
+  rec->pc = rec->insn = rec->data = 0;
+  rec->rd = rec->pdst = 0;
+  rec->fp = false;
+
+  if (in.lit("C"))
+  {
+    if (!in.dec(&x) || x > 0xffff || !in.lit(": "))
+      return false;
+    rec->has_hart = true;
+    rec->hart = x;
+  }
+
+  if (in.p < in.end && (*in.p == 'x' || *in.p == 'f'))
+  {
+    rec->kind = COMMIT_WRITEBACK;
+    return in.reg(rec) && in.pdst(rec) && in.lit(" 0x") &&
+           in.hex(&rec->data, 16) && in.p == in.end;
+  }
+
+  uint64_t priv;
+  if (!in.dec(&priv) || priv > 3 || !in.lit(" 0x") || !in.hex(&rec->pc, 16) ||
+      !in.lit(" (0x") || !in.hex(&x, 8) || !in.lit(")"))
+    return false;
+  rec->priv = priv;
+  rec->insn = x;
+  if (in.p == in.end)
+  {
+    rec->kind = COMMIT_INSN;
+    return true;
+  }
+  if (!in.lit(" ") || !in.reg(rec))
+    return false;
+  if (in.pdst(rec))
+  {
+    rec->kind = COMMIT_PARTIAL;
+    return in.lit(" 0xXXXXXXXXXXXXXXXX") && in.p == in.end;
+  }
+  rec->kind = COMMIT_INSN_RD;
+  return in.lit(" 0x") && in.hex(&rec->data, 16) && in.p == in.end;
+}
+
+// Parses one line of text; a line that wouldn't render back exactly the same
+// becomes a text record
+static inline void commit_rec_parse(const char* str, size_t len, commit_rec_t* rec,
+                                    std::string* scratch)
+{
+  scratch->clear();
+  if (commit_rec_parse_fields(str, len, rec))
+  {
+    commit_rec_format(*rec, scratch);
+    if (scratch->size() == len && memcmp(scratch->data(), str, len) == 0)
+      return;
+  }
+  rec->kind = COMMIT_TEXT;
+  rec->text = str;
+  rec->text_len = len;
+}
+
+// Encodes and decodes records; each direction keeps the previous pc of every
+// hart, so a stream must be handled by one codec from its start
+class commit_log_codec_t
+{
+ public:
+  void encode(const commit_rec_t& rec, std::vector<char>* out)
+  {
+    if (rec.kind == COMMIT_TEXT)
+    {
+      uint32_t len = rec.text_len;
+      out->push_back(COMMIT_TEXT << 2);
+      put(out, &len, 4);
+      out->insert(out->end(), rec.text, rec.text + len);
+      return;
+    }
+
+    bool insn = rec.kind != COMMIT_WRITEBACK;
+    uint64_t& last = last_pc(rec.hart);
+    bool seq = insn && rec.pc == last + 4;
+    out->push_back(rec.priv | (rec.kind << 2) | (rec.has_hart << 5) | (seq << 6) | (rec.fp << 7));
+    if (rec.has_hart)
+      put(out, &rec.hart, 2);
+    if (insn)
+    {
+      if (!seq)
+        put(out, &rec.pc, 8);
+      put(out, &rec.insn, 4);
+      last = rec.pc;
+    }
+    if (rec.kind != COMMIT_INSN)
+      put(out, &rec.rd, 1);
+    if (rec.kind == COMMIT_PARTIAL || rec.kind == COMMIT_WRITEBACK)
+      put(out, &rec.pdst, 2);
+    if (rec.kind == COMMIT_INSN_RD || rec.kind == COMMIT_WRITEBACK)
+      put(out, &rec.data, 8);
+  }
+
+  // Encodes one line of text
+  void encode_line(const char* str, size_t len, std::vector<char>* out)
+  {
+    commit_rec_t rec;
+    commit_rec_parse(str, len, &rec, &scratch);
+    encode(rec, out);
+  }
+
+  // Decodes the record at the start of buf.  Returns its size, or 0 if buf
+  // doesn't hold all of it yet.
+  size_t decode(const char* buf, size_t avail, commit_rec_t* rec)
+  {
+    const char* p = buf;
+    const char* end = buf + avail;
+    if (p == end)
+      return 0;
+
+    uint8_t tag = *p++;
+    rec->priv = tag & 3;
+    rec->kind = commit_kind_t((tag >> 2) & 7);
+    rec->has_hart = (tag >> 5) & 1;
+    bool seq = (tag >> 6) & 1;
+    rec->fp = (tag >> 7) & 1;
+    rec->hart = rec->rd = rec->pdst = 0;
+    rec->insn = 0;
+    rec->pc = rec->data = 0;
+
+    if (rec->kind == COMMIT_TEXT)
+    {
+      uint32_t len;
+      if (!get(&p, end, &len, 4) || size_t(end - p) < len)
+        return 0;
+      rec->text = p;
+      rec->text_len = len;
+      return p + len - buf;
+    }
+
+    bool insn = rec->kind != COMMIT_WRITEBACK;
+    if (rec->has_hart && !get(&p, end, &rec->hart, 2))
+      return 0;
+    if (insn)
+    {
+      if (seq)
+        rec->pc = last_pc(rec->hart) + 4;
+      else if (!get(&p, end, &rec->pc, 8))
+        return 0;
+      if (!get(&p, end, &rec->insn, 4))
+        return 0;
+    }
+    if (rec->kind != COMMIT_INSN && !get(&p, end, &rec->rd, 1))
+      return 0;
+    if ((rec->kind == COMMIT_PARTIAL || rec->kind == COMMIT_WRITEBACK) &&
+        !get(&p, end, &rec->pdst, 2))
+      return 0;
+    if ((rec->kind == COMMIT_INSN_RD || rec->kind == COMMIT_WRITEBACK) &&
+        !get(&p, end, &rec->data, 8))
+      return 0;
+
+    // only a complete record moves the pc on
+    if (insn)
+      last_pc(rec->hart) = rec->pc;
+    return p - buf;
+  }
+
+ private:
+  uint64_t& last_pc(uint16_t hart)
+  {
+    if (hart >= pcs.size())
+      pcs.resize(hart + 1, uint64_t(-4));
+    return pcs[hart];
+  }
+  static void put(std::vector<char>* out, const void* x, size_t n)
+  {
+    out->insert(out->end(), (const char*)x, (const char*)x + n);
+  }
+  static bool get(const char** p, const char* end, void* x, size_t n)
+  {
+    if (size_t(end - *p) < n)
+      return false;
+    memcpy(x, *p, n);
+    *p += n;
+    return true;
+  }
+
+  std::vector<uint64_t> pcs;
+  std::string scratch;
+};
+
+#endif
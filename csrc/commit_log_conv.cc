@@ -0,0 +1,96 @@
+// See LICENSE for license details.
+
+// commit_log_conv - converts commit logs between the text format and the
+// binary format of commit_log.h.  A binary log on stdin is rendered as text;
+// anything else is encoded as binary.
+//
+// USAGE : commit_log_conv < in > out
+
+#include "commit_log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+const size_t kChunkSize = 1 << 20;
+
+static void write_all(const char* buf, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(STDOUT_FILENO, buf, size);
+    if (n <= 0) {
+      fprintf(stderr, "commit_log_conv: write failed\n");
+      exit(1);
+    }
+    buf += n;
+    size -= n;
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 1) {
+    fprintf(stderr, "Usage: commit_log_conv < in > out\n");
+    return -1;
+  }
+
+  commit_log_codec_t codec;
+  std::vector<char> buf(kChunkSize);
+  std::vector<char> bin_out;
+  std::string text_out;
+  size_t have = 0, start = 0;
+  bool first = true, binary = false, eof = false;
+
+  while (!eof) {
+    if (have == buf.size())
+      buf.resize(2 * buf.size());  // a record longer than a whole chunk
+    ssize_t n = read(STDIN_FILENO, &buf[have], buf.size() - have);
+    if (n < 0) {
+      fprintf(stderr, "commit_log_conv: read failed\n");
+      return 1;
+    }
+    eof = n == 0;
+    have += n;
+
+    if (first) {
+      if (have < sizeof(commit_log_magic) && !eof)
+        continue;
+      first = false;
+      binary = commit_log_is_binary(&buf[0], have);
+      if (binary)
+        start = sizeof(commit_log_magic);
+      else
+        write_all(commit_log_magic, sizeof(commit_log_magic));
+    }
+
+    if (binary) {
+      commit_rec_t rec;
+      while (size_t len = codec.decode(&buf[start], have - start, &rec)) {
+        commit_rec_format(rec, &text_out);
+        text_out.push_back('\n');
+        start += len;
+      }
+      if (eof && start != have) {
+        fprintf(stderr, "commit_log_conv: truncated record at end of log\n");
+        return 1;
+      }
+      write_all(text_out.data(), text_out.size());
+      text_out.clear();
+    } else {
+      for (const char* nl; (nl = (const char*)memchr(&buf[start], '\n', have - start));
+           start = nl - &buf[0] + 1)
+        codec.encode_line(&buf[start], nl - &buf[start], &bin_out);
+      if (eof && start != have) {  // a final line without a newline
+        codec.encode_line(&buf[start], have - start, &bin_out);
+        start = have;
+      }
+      write_all(bin_out.data(), bin_out.size());
+      bin_out.clear();
+    }
+
+    memmove(&buf[0], &buf[start], have - start);
+    have -= start;
+    start = 0;
+  }
+  return 0;
+}
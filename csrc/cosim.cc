@@ -0,0 +1,169 @@
+// See LICENSE for license details.
+
+#include "cosim.h"
+#include "comlog.h"
+#include "float_fix.h"
+#include "commit_log.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+cosim_t::cosim_t(const char* ref_fn)
+  : lines([this](const char* str, size_t len) { process(str, len); }),
+    ref(NULL), ref_size(0), ref_pos(0), ref_mapped(false), ref_binary(false),
+    matched(0), mismatch(false)
+{
+  int fd = open(ref_fn, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    fprintf(stderr, "Couldn't open cosim reference %s\n", ref_fn);
+    exit(-1);
+  }
+  ref_size = st.st_size;
+  if (ref_size)
+  {
+    void* p = mmap(NULL, ref_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      fprintf(stderr, "Couldn't map cosim reference %s\n", ref_fn);
+      exit(-1);
+    }
+    madvise(p, ref_size, MADV_SEQUENTIAL);
+    ref = (const char*)p;
+    ref_mapped = true;
+  }
+  close(fd);
+
+  // a binary reference is decoded a record at a time as it is compared
+  ref_binary = commit_log_is_binary(ref, ref_size);
+  if (ref_binary)
+    ref_pos = sizeof(commit_log_magic);
+
+  rob = new Rob(kMaxPdst, [this](const char* str, size_t len, size_t prefix) {
+    compare(str + prefix, len - prefix);
+  });
+}
+
+cosim_t::~cosim_t()
+{
+  lines.flush();
+  delete rob;
+  if (ref_mapped)
+    munmap((void*)ref, ref_size);
+}
+
+bool cosim_t::check()
+{
+  lines.flush();
+  return !mismatch;
+}
+
+bool cosim_t::finish()
+{
+  lines.flush();
+  rob->flush();
+  commit_rec_t rec;
+  while (!mismatch && next_ref(&rec))
+  {
+    if (rec.kind == COMMIT_TEXT && rec.text_len == 0)
+      continue;  // blank lines
+    expected.clear();
+    commit_rec_format(rec, &expected);
+    got = "(end of target log)";
+    mismatch = true;
+  }
+  return !mismatch;
+}
+
+bool cosim_t::next_ref(commit_rec_t* rec)
+{
+  if (ref_pos >= ref_size)
+    return false;
+  if (ref_binary)
+  {
+    size_t len = ref_codec.decode(ref + ref_pos, ref_size - ref_pos, rec);
+    if (!len)
+    {
+      fprintf(stderr, "cosim reference ends in a truncated record\n");
+      exit(-1);
+    }
+    ref_pos += len;
+    return true;
+  }
+  const char* line = ref + ref_pos;
+  const char* nl = (const char*)memchr(line, '\n', ref_size - ref_pos);
+  rec->kind = COMMIT_TEXT;
+  rec->text = line;
+  rec->text_len = (nl ? nl : ref + ref_size) - line;
+  ref_pos += rec->text_len + (nl != NULL);
+  return true;
+}
+
+void cosim_t::process(const char* str, size_t len)
+{
+  if (mismatch)
+    return;
+  Line line = make_line(str, len);
+  if (line.hart == 0)
+    rob->process(line);
+}
+
+void cosim_t::compare(const char* str, size_t len)
+{
+  if (mismatch)
+    return;
+
+  commit_rec_t ref_rec;
+  if (!next_ref(&ref_rec))
+  {
+    got.assign(str, len);
+    expected = "(end of reference log)";
+    mismatch = true;
+    return;
+  }
+
+  // A text reference line is compared as text, a binary record with the
+  // fields of the target's line
+  bool same;
+  if (ref_rec.kind == COMMIT_TEXT)
+  {
+    same = len == ref_rec.text_len && memcmp(str, ref_rec.text, len) == 0;
+    if (!same)
+    {
+      got.assign(str, len);
+      expected.assign(ref_rec.text, ref_rec.text_len);
+      same = FixLine(got, expected, &fixed);
+    }
+  }
+  else
+  {
+    commit_rec_t got_rec, fixed_rec;
+    same = commit_rec_parse_fields(str, len, &got_rec) &&
+           (commit_rec_equal(got_rec, ref_rec) || FixRecord(got_rec, ref_rec, &fixed_rec));
+    if (!same)
+    {
+      got.assign(str, len);
+      expected.clear();
+      commit_rec_format(ref_rec, &expected);
+    }
+  }
+
+  if (!same)
+  {
+    mismatch = true;
+    return;
+  }
+  matched++;
+}
+
+void cosim_t::report(FILE* out)
+{
+  fprintf(out, "cosim: logs diverge at commit %ld\n"
+               "  expected: %s\n"
+               "       got: %s\n",
+          matched, expected.c_str(), got.c_str());
+}
@@ -0,0 +1,57 @@
+// See LICENSE for license details.
+
+#ifndef _COSIM_H
+#define _COSIM_H
+
+#include "commit_log.h"
+#include "line_stream.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+class Rob;
+
+// Checks the target's commit log against a reference (spike) commit log,
+// text or binary, as the simulation runs, instead of post-processing a text
+// dump with comlog and float_fix.  Trace output written to file() is reordered by hart 0's
+// ROB and each committed line is compared against the next reference line,
+// after the float_fix unrecoding if that is what makes them match.  Binary
+// references are decoded as they are reached and compared field by field.  Lines
+// from other harts are ignored.  check() processes everything printed so
+// far and returns false once the logs have diverged; finish(), at the end
+// of the run, also commits what the ROB still holds and fails if the
+// reference has lines left over.
+class cosim_t
+{
+ public:
+  cosim_t(const char* ref_fn);
+  ~cosim_t();
+
+  FILE* file() { return lines.file(); }
+  bool check();
+  bool finish();
+  bool diverged() { return mismatch; }
+  uint64_t commits() { return matched; }
+  void report(FILE* out);
+
+ private:
+  void process(const char* str, size_t len);
+  void compare(const char* str, size_t len);
+  bool next_ref(commit_rec_t* rec);
+
+  line_stream_t lines;
+  Rob* rob;
+
+  const char* ref;                    // the mapped reference log
+  size_t ref_size;
+  size_t ref_pos;
+  bool ref_mapped;
+  bool ref_binary;
+  commit_log_codec_t ref_codec;
+
+  uint64_t matched;
+  bool mismatch;
+  std::string got, expected, fixed;
+};
+
+#endif
@@ -4,11 +4,26 @@
 #include "emulator.h"
 #include "mm.h"
 #include "mm_dramsim2.h"
+#include "mm_latency.h"
+#include "checkpoint.h"
+#include "worker_pool.h"
+#include "async_file.h"
+#include "axi_trace.h"
+#include "flight_recorder.h"
+#include "cosim.h"
+#include "commit_log.h"
+#include "line_stream.h"
+#include "mm_stats.h"
+#include "profile.h"
+#include "sampler.h"
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 
 #define MEM_SIZE_BITS 3
 #define MEM_LEN_BITS 8
@@ -20,19 +35,225 @@ void handle_sigterm(int sig)
   htif->stop();
 }
 
+// Per-cycle memory steps, instantiated on each concrete model type so the
+// model's port accessors are bound statically rather than through mm_t.
+template <class model_t>
+static void mm_get_all_ports(mm_t** mm, mm_port_out_t* out, const bool* quiet)
+{
+  for (int i = 0; i < N_MEM_CHANNELS; i++)
+    if (!quiet[i])
+      mm_get_ports(static_cast<model_t*>(mm[i]), &out[i]);
+}
+
+template <class model_t>
+static bool mm_idle_tick(mm_t* mm)
+{
+  return static_cast<model_t*>(mm)->idle_tick();
+}
+
+template <class model_t>
+static void mm_tick_port(mm_t* mm, const mm_port_in_t& in)
+{
+  mm_tick(static_cast<model_t*>(mm), in);
+}
+
+// The cycles to dump waveforms for: fixed [start, end) windows from +start
+// and +vcd-window, plus a window held open by triggers.
+class dump_windows_t
+{
+ public:
+  dump_windows_t() : trigger_end(0) {}
+
+  void add(uint64_t start, uint64_t end)
+  {
+    windows.push_back(std::make_pair(start, end));
+    std::sort(windows.begin(), windows.end());
+  }
+
+  // Dump from cycle through at least cycle + cycles - 1.
+  void trigger(uint64_t cycle, uint64_t cycles)
+  {
+    trigger_end = std::max(trigger_end, cycle + cycles);
+  }
+
+  bool active(uint64_t cycle)
+  {
+    while (!windows.empty() && windows.front().second <= cycle)
+      windows.erase(windows.begin());
+    return cycle < trigger_end || (!windows.empty() && windows.front().first <= cycle);
+  }
+
+  bool empty() { return windows.empty(); }
+
+ private:
+  std::vector<std::pair<uint64_t, uint64_t> > windows;
+  uint64_t trigger_end;
+};
+
+// Trace a channel's AXI handshakes for one cycle
+static void print_mem_handshakes(FILE* f, uint64_t cycle, int channel,
+                                 const mm_port_in_t& in, const mm_port_out_t& out)
+{
+  if (in.ar_valid && out.ar_ready)
+    fprintf(f, "C%ld mem%d: AR addr 0x%016lx id %ld size %ld len %ld\n", cycle, channel,
+            in.ar_addr + MEM_BASE, in.ar_id, in.ar_size, in.ar_len);
+  if (in.aw_valid && out.aw_ready)
+    fprintf(f, "C%ld mem%d: AW addr 0x%016lx id %ld size %ld len %ld\n", cycle, channel,
+            in.aw_addr + MEM_BASE, in.aw_id, in.aw_size, in.aw_len);
+  if (in.w_valid && out.w_ready)
+    fprintf(f, "C%ld mem%d: W strb 0x%lx last %d\n", cycle, channel, in.w_strb, in.w_last);
+  if (out.r_valid && in.r_ready)
+    fprintf(f, "C%ld mem%d: R id %ld resp %ld last %d\n", cycle, channel, out.r_id, out.r_resp, out.r_last);
+  if (out.b_valid && in.b_ready)
+    fprintf(f, "C%ld mem%d: B id %ld resp %ld\n", cycle, channel, out.b_id, out.b_resp);
+}
+
+// A +batch list file: one test per line, a binary and its arguments.
+// Blank lines and lines starting with # are skipped.
+static std::vector<std::vector<std::string> > read_batch(const char* fn)
+{
+  std::ifstream in(fn);
+  if (!in)
+  {
+    fprintf(stderr, "Couldn't open %s\n", fn);
+    exit(-1);
+  }
+  std::vector<std::vector<std::string> > tests;
+  for (std::string line; std::getline(in, line); )
+  {
+    std::istringstream words(line);
+    std::vector<std::string> test;
+    for (std::string word; words >> word; )
+      test.push_back(word);
+    if (!test.empty() && test[0][0] != '#')
+      tests.push_back(test);
+  }
+  return tests;
+}
+
+// fesvr's arguments for one batch test: the emulator's own options, which
+// fesvr also reads, followed by the test
+static std::vector<std::string> batch_htif_args(int argc, char** argv,
+                                                const std::vector<std::string>& test)
+{
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++)
+    if (argv[i][0] == '+' || argv[i][0] == '-')
+      args.push_back(argv[i]);
+  args.insert(args.end(), test.begin(), test.end());
+  return args;
+}
+
+// Memory models selectable with +memmodel=; checkpoints record which one
+// was in use (magic and dramsim keep the values of the old +dramsim flag).
+enum memmodel_t { MEMMODEL_MAGIC, MEMMODEL_DRAMSIM2, MEMMODEL_LATENCY };
+
+static const char ckpt_magic[8] = "rckpt01";
+
+// The generated model keeps all of its state in plain dat_t/mem_t members,
+// so it is checkpointed as the raw bytes that follow its mod_t base.
+static char* tile_state(Top_t& tile) { return (char*)&tile + sizeof(mod_t); }
+static const size_t tile_state_size = sizeof(Top_t) - sizeof(mod_t);
+
+static void save_checkpoint(const char* fn, Top_t& tile, mm_t** mm, memmodel_t memmodel,
+                            uint64_t trace_count, bool htif_in_valid, val_t htif_in_bits)
+{
+  FILE* f = fopen(fn, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "could not open %s\n", fn);
+    exit(-1);
+  }
+
+  ckpt_write(f, ckpt_magic, sizeof(ckpt_magic));
+  ckpt_put<uint64_t>(f, tile_state_size);
+  ckpt_put<uint64_t>(f, N_MEM_CHANNELS);
+  ckpt_put<uint8_t>(f, memmodel);
+  ckpt_put(f, trace_count);
+
+  ckpt_write(f, tile_state(tile), tile_state_size);
+  ckpt_put(f, htif_in_valid);
+  ckpt_put(f, htif_in_bits);
+  for (int i = 0; i < N_MEM_CHANNELS; i++)
+    mm[i]->save(f);
+
+  fclose(f);
+}
+
+static void restore_checkpoint(const char* fn, Top_t& tile, mm_t** mm, memmodel_t memmodel,
+                               uint64_t* trace_count, bool* htif_in_valid, val_t* htif_in_bits)
+{
+  FILE* f = fopen(fn, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "could not open %s\n", fn);
+    exit(-1);
+  }
+
+  char magic[sizeof(ckpt_magic)];
+  ckpt_read(f, magic, sizeof(magic));
+  if (memcmp(magic, ckpt_magic, sizeof(magic)) != 0 ||
+      ckpt_get<uint64_t>(f) != tile_state_size ||
+      ckpt_get<uint64_t>(f) != N_MEM_CHANNELS)
+  {
+    fprintf(stderr, "%s is not a checkpoint of this emulator\n", fn);
+    exit(-1);
+  }
+  if (ckpt_get<uint8_t>(f) != memmodel)
+  {
+    fprintf(stderr, "%s was checkpointed with a different +memmodel\n", fn);
+    exit(-1);
+  }
+  *trace_count = ckpt_get<uint64_t>(f);
+
+  ckpt_read(f, tile_state(tile), tile_state_size);
+  *htif_in_valid = ckpt_get<bool>(f);
+  *htif_in_bits = ckpt_get<val_t>(f);
+  for (int i = 0; i < N_MEM_CHANNELS; i++)
+    mm[i]->restore(f);
+
+  fclose(f);
+}
+
 int main(int argc, char** argv)
 {
   unsigned random_seed = (unsigned)time(NULL) ^ (unsigned)getpid();
   uint64_t max_cycles = -1;
   uint64_t trace_count = 0;
   uint64_t start = 0;
+  bool start_given = false;
+  dump_windows_t dump_windows;
+  bool trigger_htif = false;
+  uint64_t trigger_addr = -1;
+  uint64_t trigger_cycles = 10000;
+  uint64_t checkpoint_at = -1;
   int ret = 0;
   const char* vcd = NULL;
   const char* loadmem = NULL;
+  const char* loadmem_cache = NULL;
+  const char* checkpoint = "emulator.ckpt";
+  const char* restore = NULL;
+  const char* cosim_ref = NULL;
+  const char* commit_log_fn = NULL;
+  const char* stats_json = NULL;
+  const char* axi_trace_fn = NULL;
+  const char* sample_fn = "emulator.samples.csv";
+  const char* batch_fn = NULL;
+  const char* batch_results_fn = NULL;
+  bool program_given = false;
+  uint64_t sample_interval = 0;
+  bool print_stats = false;
+  uint64_t profile_interval = 0;
   FILE *vcdfile = NULL;
-  bool dramsim2 = false;
+  memmodel_t memmodel = MEMMODEL_MAGIC;
+  mm_latency_params_t latency_params;
+  uint64_t dramsim_clock[2] = {1, 1};
+  bool dramsim_skip_idle = false;
   bool log = false;
   bool print_cycles = false;
+  bool mm_threads = false;
+  uint64_t recorder_cycles = 0;
+  uint64_t recorder_bytes = 64 << 20;
   uint64_t memsz_mb = MEM_SIZE / (1024*1024);
   mm_t *mm[N_MEM_CHANNELS];
 
@@ -45,26 +266,158 @@ int main(int argc, char** argv)
       memsz_mb = atoll(argv[i]+9);
     else if (arg.substr(0, 2) == "-s")
       random_seed = atoi(argv[i]+2);
-    else if (arg == "+dramsim")
-      dramsim2 = true;
+    else if (arg == "+dramsim" || arg == "+memmodel=dramsim")
+      memmodel = MEMMODEL_DRAMSIM2;
+    else if (arg.substr(0, 15) == "+dramsim-clock=")
+    {
+      // <dram cycles>:<cpu cycles>, e.g. 2:3 for a 2 GHz DRAM bus and 3 GHz core
+      char* end;
+      dramsim_clock[0] = strtoull(argv[i]+15, &end, 0);
+      dramsim_clock[1] = *end == ':' ? strtoull(end+1, &end, 0) : 0;
+      if (*end || !dramsim_clock[0] || !dramsim_clock[1])
+      {
+        fprintf(stderr, "bad %s: expected +dramsim-clock=<dram cycles>:<cpu cycles>\n", argv[i]);
+        exit(-1);
+      }
+    }
+    else if (arg == "+dramsim-skip-idle")
+      dramsim_skip_idle = true;
+    else if (arg == "+dramsim-exact") // deprecated: exact is the default
+      dramsim_skip_idle = false;
+    else if (arg == "+memmodel=magic")
+      memmodel = MEMMODEL_MAGIC;
+    else if (arg.substr(0, 17) == "+memmodel=latency")
+    {
+      memmodel = MEMMODEL_LATENCY;
+      if (argv[i][17] && (argv[i][17] != ':' || !latency_params.parse(argv[i]+18)))
+      {
+        fprintf(stderr, "bad %s: expected +memmodel=latency[:read=<n>,write=<n>,"
+                "banks=<n>,busy=<n>,bw=<bytes/cycle>,outstanding=<n>]\n", argv[i]);
+        exit(-1);
+      }
+    }
+    else if (arg.substr(0, 10) == "+memmodel=")
+    {
+      fprintf(stderr, "unknown memory model %s (magic, dramsim or latency)\n", argv[i]+10);
+      exit(-1);
+    }
     else if (arg == "+verbose")
       log = true;
     else if (arg.substr(0, 12) == "+max-cycles=")
       max_cycles = atoll(argv[i]+12);
     else if (arg.substr(0, 9) == "+loadmem=")
       loadmem = argv[i]+9;
+    else if (arg.substr(0, 15) == "+loadmem-cache=")
+      loadmem_cache = argv[i]+15;
+    else if (arg == "+loadmem-cache")
+      loadmem_cache = default_mem_cache_dir;
     else if (arg.substr(0, 7) == "+start=")
+    {
       start = atoll(argv[i]+7);
+      start_given = true;
+    }
+    else if (arg.substr(0, 12) == "+vcd-window=")
+    {
+      char* end;
+      uint64_t window_start = strtoull(argv[i]+12, &end, 0);
+      uint64_t window_end = *end == ':' && end[1] ? strtoull(end+1, NULL, 0) : -1;
+      dump_windows.add(window_start, window_end);
+    }
+    else if (arg == "+vcd-trigger=htif")
+      trigger_htif = true;
+    else if (arg.substr(0, 19) == "+vcd-trigger=write:")
+      trigger_addr = strtoull(argv[i]+19, NULL, 0);
+    else if (arg.substr(0, 20) == "+vcd-trigger-cycles=")
+      trigger_cycles = atoll(argv[i]+20);
     else if (arg.substr(0, 12) == "+cycle-count")
       print_cycles = true;
+    else if (arg.substr(0, 15) == "+checkpoint-at=")
+      checkpoint_at = atoll(argv[i]+15);
+    else if (arg.substr(0, 12) == "+checkpoint=")
+      checkpoint = argv[i]+12;
+    else if (arg.substr(0, 9) == "+restore=")
+      restore = argv[i]+9;
+    else if (arg == "+mm-threads")
+      mm_threads = true;
+    else if (arg.substr(0, 17) == "+flight-recorder=")
+      recorder_cycles = atoll(argv[i]+17);
+    else if (arg.substr(0, 23) == "+flight-recorder-bytes=")
+      recorder_bytes = atoll(argv[i]+23);
+    else if (arg.substr(0, 7) == "+cosim=")
+      cosim_ref = argv[i]+7;
+    else if (arg.substr(0, 12) == "+commit-log=")
+      commit_log_fn = argv[i]+12;
+    else if (arg.substr(0, 11) == "+axi-trace=")
+      axi_trace_fn = argv[i]+11;
+    else if (arg.substr(0, 17) == "+sample-interval=")
+      sample_interval = atoll(argv[i]+17);
+    else if (arg.substr(0, 13) == "+sample-file=")
+      sample_fn = argv[i]+13;
+    else if (arg == "+stats")
+      print_stats = true;
+    else if (arg.substr(0, 12) == "+stats-json=")
+      stats_json = argv[i]+12;
+    else if (arg == "+profile")
+      profile_interval = 64;
+    else if (arg.substr(0, 9) == "+profile=")
+      profile_interval = atoll(argv[i]+9);
+    else if (arg.substr(0, 7) == "+batch=")
+      batch_fn = argv[i]+7;
+    else if (arg.substr(0, 15) == "+batch-results=")
+      batch_results_fn = argv[i]+15;
+    else if (argv[i][0] != '+' && argv[i][0] != '-')
+      program_given = true;
+  }
+
+  // With +batch=<listfile>, the tests in listfile are run one after another
+  // in this process, each starting from reset with zeroed memory and its own
+  // fesvr.  Target state that reset doesn't define carries over from the
+  // previous test rather than being randomized, as does DRAMSim2's clock,
+  // so with +memmodel=dramsim refresh can land on different cycles than in
+  // a separate run.  A line "<exit code> <cycles> <test>" is written per
+  // test to +batch-results=<file> (stdout).
+  std::vector<std::vector<std::string> > batch;
+  FILE* batch_results = stdout;
+  if (batch_fn)
+  {
+    if (restore || loadmem || cosim_ref || checkpoint_at != uint64_t(-1) || program_given)
+    {
+      fprintf(stderr, "+batch can't be combined with a program, +restore, +loadmem, "
+              "+cosim or +checkpoint-at\n");
+      exit(-1);
+    }
+    batch = read_batch(batch_fn);
+    if (batch.empty())
+    {
+      fprintf(stderr, "%s lists no tests\n", batch_fn);
+      exit(-1);
+    }
+    if (batch_results_fn && !(batch_results = fopen(batch_results_fn, "w")))
+    {
+      fprintf(stderr, "Couldn't open %s\n", batch_results_fn);
+      exit(-1);
+    }
   }
 
+  // With +profile[=<interval>], host time is broken down by loop phase,
+  // timing every interval-th cycle (default 64).
+  profile_t* profile = NULL;
+  if (profile_interval)
+    profile = new profile_t(profile_interval);
+
   const int disasm_len = 24;
   if (vcd)
   {
-    // Create a VCD file
-    vcdfile = strcmp(vcd, "-") == 0 ? stdout : fopen(vcd, "w");
+    // Create a VCD file.  Files are written by a background thread, and
+    // gzip-compressed if their name ends in .gz.
+    size_t vcd_len = strlen(vcd);
+    bool vcd_gz = vcd_len > 3 && strcmp(vcd + vcd_len - 3, ".gz") == 0;
+    vcdfile = strcmp(vcd, "-") == 0 ? stdout : async_fopen(vcd, vcd_gz);
     assert(vcdfile);
+
+    // Without windows or triggers, dump the whole run (from +start)
+    if (start_given || (dump_windows.empty() && !trigger_htif && trigger_addr == uint64_t(-1)))
+      dump_windows.add(start, -1);
     fprintf(vcdfile, "$scope module Testbench $end\n");
     fprintf(vcdfile, "$var reg %d NDISASM_WB wb_instruction $end\n", disasm_len*8);
     fprintf(vcdfile, "$var reg 64 NCYCLE cycle $end\n");
@@ -81,7 +434,17 @@ int main(int argc, char** argv)
 
   // Instantiate and initialize main memory
   for (int i = 0; i < N_MEM_CHANNELS; i++) {
-    mm[i] = dramsim2 ? (mm_t*)(new mm_dramsim2_t) : (mm_t*)(new mm_magic_t);
+    if (memmodel == MEMMODEL_DRAMSIM2)
+    {
+      mm_dramsim2_t* dramsim = new mm_dramsim2_t;
+      dramsim->set_clock_ratio(dramsim_clock[0], dramsim_clock[1]);
+      dramsim->set_skip_idle(dramsim_skip_idle);
+      mm[i] = dramsim;
+    }
+    else if (memmodel == MEMMODEL_LATENCY)
+      mm[i] = new mm_latency_t(latency_params);
+    else
+      mm[i] = new mm_magic_t;
     try {
       mm[i]->init(memsz_mb*1024*1024 / N_MEM_CHANNELS, mem_width, CACHE_BLOCK_BYTES);
     } catch (const std::bad_alloc& e) {
@@ -93,28 +456,44 @@ int main(int argc, char** argv)
     }
   }
 
-  if (loadmem) {
+  // With +loadmem-cache[=<dir>], loaded images are kept in dir (default
+  // /dev/shm) and later runs, such as other seeds, map them copy-on-write.
+  if (loadmem && loadmem_cache) {
+    load_mem_cached(mm, loadmem, CACHE_BLOCK_BYTES, N_MEM_CHANNELS, MEM_BASE, loadmem_cache);
+  } else if (loadmem) {
     void *mems[N_MEM_CHANNELS];
     for (int i = 0; i < N_MEM_CHANNELS; i++)
       mems[i] = mm[i]->get_data();
-    load_mem(mems, loadmem, CACHE_BLOCK_BYTES, N_MEM_CHANNELS);
+    load_mem(mems, loadmem, CACHE_BLOCK_BYTES, N_MEM_CHANNELS, MEM_BASE, mm[0]->get_size());
   }
 
+  // The testbench side of the HTIF link
+  bool htif_in_valid = false;
+  val_t htif_in_bits = 0;
+
+  if (restore)
+    restore_checkpoint(restore, tile, mm, memmodel, &trace_count, &htif_in_valid, &htif_in_bits);
+
   // Instantiate HTIF
-  htif = new htif_emulator_t(std::vector<std::string>(argv + 1, argv + argc));
+  htif = new htif_emulator_t(batch.empty() ? std::vector<std::string>(argv + 1, argv + argc)
+                                           : batch_htif_args(argc, argv, batch[0]));
   int htif_bits = tile.Top__io_host_in_bits.width();
   assert(htif_bits % 8 == 0 && htif_bits <= val_n_bits());
 
   signal(SIGTERM, handle_sigterm);
 
   // reset for one host_clk cycle to handle pipelined reset
-  tile.Top__io_host_in_valid = LIT<1>(0);
-  tile.Top__io_host_out_ready = LIT<1>(0);
-  for (int i = 0; i < 3; i += tile.Top__io_host_clk_edge.to_bool())
-  {
-    tile.clock_lo(LIT<1>(1));
-    tile.clock_hi(LIT<1>(1));
-  }
+  auto reset_tile = [&]() {
+    tile.Top__io_host_in_valid = LIT<1>(0);
+    tile.Top__io_host_out_ready = LIT<1>(0);
+    for (int i = 0; i < 3; i += tile.Top__io_host_clk_edge.to_bool())
+    {
+      tile.clock_lo(LIT<1>(1));
+      tile.clock_hi(LIT<1>(1));
+    }
+  };
+  if (!restore)
+    reset_tile();
 
   dat_t<1> *mem_ar_valid[N_MEM_CHANNELS];
   dat_t<1> *mem_ar_ready[N_MEM_CHANNELS];
@@ -150,24 +529,267 @@ int main(int argc, char** argv)
 
 #include TBFRAG
 
-  while (!htif->done() && trace_count < max_cycles && ret == 0)
+  // Choose the model's port exchange once, not per call and per port.
+  void (*get_all_ports)(mm_t**, mm_port_out_t*, const bool*) = mm_get_all_ports<mm_magic_t>;
+  bool (*idle_tick)(mm_t*) = mm_idle_tick<mm_magic_t>;
+  void (*tick_port)(mm_t*, const mm_port_in_t&) = mm_tick_port<mm_magic_t>;
+  if (memmodel == MEMMODEL_DRAMSIM2)
+  {
+    get_all_ports = mm_get_all_ports<mm_dramsim2_t>;
+    idle_tick = mm_idle_tick<mm_dramsim2_t>;
+    tick_port = mm_tick_port<mm_dramsim2_t>;
+  }
+  else if (memmodel == MEMMODEL_LATENCY)
   {
+    get_all_ports = mm_get_all_ports<mm_latency_t>;
+    idle_tick = mm_idle_tick<mm_latency_t>;
+    tick_port = mm_tick_port<mm_latency_t>;
+  }
+  mm_port_in_t mm_in[N_MEM_CHANNELS];
+  mm_port_out_t mm_out[N_MEM_CHANNELS];
+
+  // Channels that accepted a write burst covering the +vcd-trigger address
+  bool mm_write_hit[N_MEM_CHANNELS];
+  for (int i = 0; i < N_MEM_CHANNELS; i++)
+    mm_write_hit[i] = false;
+
+  // A channel is quiet when its last tick was an idle one: its state, and
+  // so the ports already driven from it, haven't changed since.
+  bool mm_quiet[N_MEM_CHANNELS];
+  for (int i = 0; i < N_MEM_CHANNELS; i++)
+    mm_quiet[i] = false;
+
+  // With +stats or +stats-json=<file>, per-channel traffic counters are
+  // kept and reported at exit.  +sample-interval=<n> reads them too.
+  std::vector<mm_stats_t> mm_stats;
+  if (print_stats || stats_json || sample_interval)
+    mm_stats.assign(N_MEM_CHANNELS, mm_stats_t(mem_width));
+  mm_stats_t* stats = mm_stats.empty() ? NULL : &mm_stats[0];
+
+  auto tick_channel = [&](int i) {
+    bool request = mem_ar_valid[i]->to_bool() || mem_aw_valid[i]->to_bool() ||
+                   mem_w_valid[i]->to_bool();
+    mm_quiet[i] = !request && idle_tick(mm[i]);
+    if (mm_quiet[i])
+    {
+      if (stats)
+        stats[i].idle();
+      return;
+    }
+
+    mm_port_in_t& in = mm_in[i];
+    in.ar_valid = mem_ar_valid[i]->to_bool();
+    in.ar_addr = mem_ar_bits_addr[i]->lo_word() - MEM_BASE;
+    in.ar_id = mem_ar_bits_id[i]->lo_word();
+    in.ar_size = mem_ar_bits_size[i]->lo_word();
+    in.ar_len = mem_ar_bits_len[i]->lo_word();
+
+    in.aw_valid = mem_aw_valid[i]->to_bool();
+    in.aw_addr = mem_aw_bits_addr[i]->lo_word() - MEM_BASE;
+    in.aw_id = mem_aw_bits_id[i]->lo_word();
+    in.aw_size = mem_aw_bits_size[i]->lo_word();
+    in.aw_len = mem_aw_bits_len[i]->lo_word();
+
+    in.w_valid = mem_w_valid[i]->to_bool();
+    in.w_strb = mem_w_bits_strb[i]->lo_word();
+    in.w_data = mem_w_bits_data[i]->values;
+    in.w_last = mem_w_bits_last[i]->to_bool();
+
+    in.r_ready = mem_r_ready[i]->to_bool();
+    in.b_ready = mem_b_ready[i]->to_bool();
+
+    if (in.aw_valid && mm_out[i].aw_ready && trigger_addr != uint64_t(-1))
+    {
+      uint64_t aw_addr = mem_aw_bits_addr[i]->lo_word();
+      uint64_t aw_bytes = (in.aw_len + 1) << in.aw_size;
+      mm_write_hit[i] = trigger_addr >= aw_addr && trigger_addr - aw_addr < aw_bytes;
+    }
+
+    if (stats)
+      stats[i].tick(trace_count, in, mm_out[i], mm[i]->rresp_depth(), mm[i]->bresp_depth());
+
+    tick_port(mm[i], in);
+  };
+
+  // With +axi-trace=<file>, every memory handshake is recorded in a binary
+  // trace that mm_replay can feed back into any memory model.
+  axi_trace_writer_t* axi_trace = NULL;
+  if (axi_trace_fn)
+  {
+    FILE* f = async_fopen(axi_trace_fn, false);
+    if (!f)
+    {
+      fprintf(stderr, "Couldn't open %s\n", axi_trace_fn);
+      exit(-1);
+    }
+    axi_trace = new axi_trace_writer_t(f, N_MEM_CHANNELS, mem_width, CACHE_BLOCK_BYTES,
+                                       memsz_mb*1024*1024 / N_MEM_CHANNELS);
+  }
+
+  worker_pool_t* mm_pool = NULL;
+  if (mm_threads && N_MEM_CHANNELS > 1)
+    mm_pool = new worker_pool_t(N_MEM_CHANNELS, tick_channel);
+
+  // With +flight-recorder=<n>, the last n cycles of trace output and AXI
+  // handshakes are kept in memory and written to stderr if the run fails.
+  flight_recorder_t* recorder = NULL;
+  if (recorder_cycles)
+    recorder = new flight_recorder_t(recorder_cycles, recorder_bytes);
+
+  // With +cosim=<spike log>, commits are checked against the reference log
+  // as they happen, and the run stops at the first divergence.
+  cosim_t* cosim = NULL;
+  if (cosim_ref)
+    cosim = new cosim_t(cosim_ref);
+  bool cosim_failed = false;
+
+  // With +commit-log=<file>, trace output (from +start) is also written as a
+  // binary commit log, from a background thread.
+  FILE* commit_log = NULL;
+  line_stream_t* commit_log_lines = NULL;
+  commit_log_codec_t commit_log_codec;
+  std::vector<char> commit_log_rec;
+  if (commit_log_fn)
+  {
+    commit_log = async_fopen(commit_log_fn, false);
+    if (!commit_log)
+    {
+      fprintf(stderr, "Couldn't open commit log %s\n", commit_log_fn);
+      exit(-1);
+    }
+    fwrite(commit_log_magic, 1, sizeof(commit_log_magic), commit_log);
+    commit_log_lines = new line_stream_t([&](const char* str, size_t len) {
+      commit_log_rec.clear();
+      commit_log_codec.encode_line(str, len, &commit_log_rec);
+      fwrite(commit_log_rec.data(), 1, commit_log_rec.size(), commit_log);
+    });
+  }
+
+  // With +sample-interval=<n>, a CSV row of progress and memory traffic is
+  // written every n cycles to +sample-file=<file> (emulator.samples.csv).
+  sampler_t* sampler = NULL;
+  if (sample_interval)
+  {
+    FILE* f = async_fopen(sample_fn, false);
+    if (!f)
+    {
+      fprintf(stderr, "Couldn't open %s\n", sample_fn);
+      exit(-1);
+    }
+    sampler = new sampler_t(f, sample_interval, N_MEM_CHANNELS, trace_count);
+  }
+
+  uint64_t htif_mem_requests = 0;
+  bool dumped = false;
+
+  // The current batch test, the cycle it started at, and per-batch totals
+  size_t batch_test = 0;
+  uint64_t test_start = 0;
+  size_t batch_failed = 0;
+  int batch_ret = 0;
+  uint64_t batch_htif_requests = 0, batch_htif_mem_requests = 0;
+
+  // htif_pthread_t's host thread never returns: once the test is done it
+  // keeps switching back to the target, parked inside its context_t.
+  // Deleting one would leave that thread blocked in freed memory, so each
+  // finished test's HTIF, with its thread and stack, is kept until exit.
+  std::vector<htif_emulator_t*> batch_retired;
+
+  // Records the result of the current batch test and, unless it was the
+  // last or the model threw, resets everything for the next one.  Requests
+  // the target left with the memory models are dropped by their reset().
+  auto batch_next = [&]() -> bool {
+    int code = ret ? ret : htif->exit_code() ? htif->exit_code() : !htif->done() ? 2 : 0;
+    std::string name;
+    for (auto& word: batch[batch_test])
+      name += (name.empty() ? "" : " ") + word;
+    fprintf(batch_results, "%d %ld %s\n", code, trace_count - test_start, name.c_str());
+    fflush(batch_results);
+    if (code)
+    {
+      batch_failed++;
+      if (!batch_ret)
+        batch_ret = code;
+    }
+    if (ret || ++batch_test == batch.size())
+      return false;
+
+    batch_htif_requests += htif->requests();
+    batch_htif_mem_requests += htif->mem_requests();
+    batch_retired.push_back(htif);
+    htif = new htif_emulator_t(batch_htif_args(argc, argv, batch[batch_test]));
+    htif_in_valid = false;
+    htif_in_bits = 0;
+    htif_mem_requests = 0;
+    for (int i = 0; i < N_MEM_CHANNELS; i++)
+    {
+      mm[i]->reset();
+      mm_quiet[i] = false;
+      mm_write_hit[i] = false;
+      if (stats)
+        stats[i].drop_outstanding();
+    }
+    reset_tile();
+    test_start = trace_count;
+    return true;
+  };
+
+  if (profile)
+    profile->loop_start();
+
+  while (ret == 0)
+  {
+    if (htif->done() || trace_count - test_start >= max_cycles)
+      if (batch.empty() || !batch_next())
+        break;
+
+    if (profile)
+      profile->cycle(trace_count);
+
+    if (sampler && sampler->due(trace_count))
+      sampler->sample(trace_count, stats, batch_htif_requests + htif->requests(),
+                      batch_htif_mem_requests + htif->mem_requests());
+
+    // Checkpoint at the first cycle at or after +checkpoint-at where the
+    // memory models and the HTIF link have nothing in flight that can't be
+    // saved.  Host-side (fesvr) state is not part of the checkpoint, so the
+    // restored target must not be in the middle of a host request.
+    if (trace_count >= checkpoint_at && !htif_in_valid && htif->link_idle())
+    {
+      bool ready = true;
+      for (int i = 0; i < N_MEM_CHANNELS; i++)
+        ready = ready && mm[i]->checkpointable();
+      if (ready)
+      {
+        save_checkpoint(checkpoint, tile, mm, memmodel, trace_count, htif_in_valid, htif_in_bits);
+        fprintf(stderr, "Wrote checkpoint %s at cycle %ld\n", checkpoint, trace_count);
+        checkpoint_at = -1;
+      }
+    }
+
+    get_all_ports(mm, mm_out, mm_quiet);
     for (int i = 0; i < N_MEM_CHANNELS; i++) {
-      *mem_ar_ready[i] = LIT<1>(mm[i]->ar_ready());
-      *mem_aw_ready[i] = LIT<1>(mm[i]->aw_ready());
-      *mem_w_ready[i] = LIT<1>(mm[i]->w_ready());
+      if (mm_quiet[i])
+        continue;
+
+      const mm_port_out_t& out = mm_out[i];
+      *mem_ar_ready[i] = LIT<1>(out.ar_ready);
+      *mem_aw_ready[i] = LIT<1>(out.aw_ready);
+      *mem_w_ready[i] = LIT<1>(out.w_ready);
 
-      *mem_b_valid[i] = LIT<1>(mm[i]->b_valid());
-      *mem_b_bits_resp[i] = LIT<64>(mm[i]->b_resp());
-      *mem_b_bits_id[i] = LIT<64>(mm[i]->b_id());
+      *mem_b_valid[i] = LIT<1>(out.b_valid);
+      *mem_b_bits_resp[i] = LIT<64>(out.b_resp);
+      *mem_b_bits_id[i] = LIT<64>(out.b_id);
 
-      *mem_r_valid[i] = LIT<1>(mm[i]->r_valid());
-      *mem_r_bits_resp[i] = LIT<64>(mm[i]->r_resp());
-      *mem_r_bits_id[i] = LIT<64>(mm[i]->r_id());
-      *mem_r_bits_last[i] = LIT<1>(mm[i]->r_last());
+      *mem_r_valid[i] = LIT<1>(out.r_valid);
+      *mem_r_bits_resp[i] = LIT<64>(out.r_resp);
+      *mem_r_bits_id[i] = LIT<64>(out.r_id);
+      *mem_r_bits_last[i] = LIT<1>(out.r_last);
 
-      memcpy(mem_r_bits_data[i]->values, mm[i]->r_data(), mem_width);
+      memcpy(mem_r_bits_data[i]->values, out.r_data, mem_width);
     }
+    if (profile)
+      profile->phase(profile_t::MARSHAL);
 
     try {
       tile.clock_lo(LIT<1>(0));
@@ -176,35 +798,20 @@ int main(int argc, char** argv)
       ret = 1;
       std::cerr << e.what() << std::endl;
     }
-
-    for (int i = 0; i < N_MEM_CHANNELS; i++) {
-      mm[i]->tick(
-        mem_ar_valid[i]->to_bool(),
-        mem_ar_bits_addr[i]->lo_word() - MEM_BASE,
-        mem_ar_bits_id[i]->lo_word(),
-        mem_ar_bits_size[i]->lo_word(),
-        mem_ar_bits_len[i]->lo_word(),
-
-        mem_aw_valid[i]->to_bool(),
-        mem_aw_bits_addr[i]->lo_word() - MEM_BASE,
-        mem_aw_bits_id[i]->lo_word(),
-        mem_aw_bits_size[i]->lo_word(),
-        mem_aw_bits_len[i]->lo_word(),
-
-        mem_w_valid[i]->to_bool(),
-        mem_w_bits_strb[i]->lo_word(),
-        mem_w_bits_data[i]->values,
-        mem_w_bits_last[i]->to_bool(),
-
-        mem_r_ready[i]->to_bool(),
-        mem_b_ready[i]->to_bool()
-      );
-    }
+    if (profile)
+      profile->phase(profile_t::CLOCK_LO);
+
+    // With +mm-threads, channels other than 0 tick on worker threads,
+    // overlapped with channel 0 and the HTIF handshake.
+    if (mm_pool)
+      mm_pool->start();
+    for (int i = 0; i < (mm_pool ? 1 : N_MEM_CHANNELS); i++)
+      tick_channel(i);
+    if (profile)
+      profile->phase(profile_t::MM_TICK);
 
     if (tile.Top__io_host_clk_edge.to_bool())
     {
-      static bool htif_in_valid = false;
-      static val_t htif_in_bits;
       if (tile.Top__io_host_in_ready.to_bool() || !htif_in_valid)
         htif_in_valid = htif->recv_nonblocking(&htif_in_bits, htif_bits/8);
       tile.Top__io_host_in_valid = LIT<1>(htif_in_valid);
@@ -214,22 +821,157 @@ int main(int argc, char** argv)
         htif->send(tile.Top__io_host_out_bits.values, htif_bits/8);
       tile.Top__io_host_out_ready = LIT<1>(1);
     }
+    if (profile)
+      profile->phase(profile_t::HTIF);
+
+    if (mm_pool)
+      mm_pool->wait();
+    if (profile)
+      profile->phase(profile_t::MM_TICK);
+
+    if (axi_trace)
+      for (int i = 0; i < N_MEM_CHANNELS; i++)
+        if (!mm_quiet[i])
+          axi_trace->record(trace_count, i, mm_in[i], mm_out[i]);
 
     if (log && trace_count >= start)
       tile.print(stderr);
 
-    // make sure we dump on cycle 0 to get dump_init
-    if (vcd && (trace_count == 0 || trace_count >= start))
-      tile.dump(vcdfile, trace_count);
+    if (commit_log && trace_count >= start)
+      tile.print(commit_log_lines->file());
+
+    if (cosim)
+    {
+      tile.print(cosim->file());
+      if (!cosim->check())
+      {
+        cosim_failed = true;
+        ret = 3;
+      }
+    }
+
+    if (recorder)
+    {
+      recorder->next_cycle();
+      tile.print(recorder->file());
+      for (int i = 0; i < N_MEM_CHANNELS; i++)
+        if (!mm_quiet[i])
+          print_mem_handshakes(recorder->file(), trace_count, i, mm_in[i], mm_out[i]);
+    }
+
+    if (vcd)
+    {
+      if (trigger_htif && htif->mem_requests() != htif_mem_requests)
+      {
+        htif_mem_requests = htif->mem_requests();
+        dump_windows.trigger(trace_count, trigger_cycles);
+      }
+      for (int i = 0; i < N_MEM_CHANNELS; i++)
+      {
+        if (mm_write_hit[i])
+          dump_windows.trigger(trace_count, trigger_cycles);
+        mm_write_hit[i] = false;
+      }
+
+      // make sure the first dump is at time 0 to get dump_init
+      if (dump_windows.active(trace_count))
+      {
+        tile.dump(vcdfile, dumped ? trace_count : 0);
+        dumped = true;
+      }
+    }
+    if (profile)
+      profile->phase(profile_t::PRINT);
 
     tile.clock_hi(LIT<1>(0));
+    if (profile)
+      profile->phase(profile_t::CLOCK_HI);
     trace_count++;
   }
 
-  if (vcd)
-    fclose(vcdfile);
+  if (!batch.empty() && ret)
+    batch_next();
+
+  // A target that exits before committing all of the reference fails too
+  if (cosim && !cosim_failed && ret == 0 && htif->done() && !cosim->finish())
+  {
+    cosim_failed = true;
+    ret = 3;
+  }
+
+  if (profile)
+  {
+    profile->cycle(0); // close out the last sampled cycle
+    profile->report(stderr, trace_count);
+    delete profile;
+  }
+
+  if (sampler)
+  {
+    sampler->finish(trace_count, stats, batch_htif_requests + htif->requests(),
+                    batch_htif_mem_requests + htif->mem_requests());
+    delete sampler;
+  }
+
+  delete mm_pool;
+  delete axi_trace;
 
-  if (htif->exit_code())
+  if (vcd && fclose(vcdfile) != 0)
+    fprintf(stderr, "Error writing %s; it is incomplete\n", vcd);
+
+  if (commit_log)
+  {
+    delete commit_log_lines;
+    if (fclose(commit_log) != 0)
+      fprintf(stderr, "Error writing %s; it is incomplete\n", commit_log_fn);
+  }
+
+  if (print_stats)
+    for (int i = 0; i < N_MEM_CHANNELS; i++)
+      mm_stats[i].report(stderr, i);
+  if (stats_json)
+  {
+    FILE* f = fopen(stats_json, "w");
+    if (!f)
+    {
+      fprintf(stderr, "Couldn't open %s\n", stats_json);
+      exit(-1);
+    }
+    fprintf(f, "{\"cycles\": %ld, \"channels\": [", trace_count);
+    for (int i = 0; i < N_MEM_CHANNELS; i++)
+    {
+      fprintf(f, i ? ",\n  " : "\n  ");
+      mm_stats[i].json(f);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+  }
+
+  if (recorder)
+  {
+    if (ret || htif->exit_code() || trace_count - test_start >= max_cycles)
+    {
+      fprintf(stderr, "*** flight recorder: up to %ld cycles before cycle %ld ***\n",
+              recorder_cycles, trace_count);
+      recorder->dump(stderr);
+    }
+    delete recorder;
+  }
+
+  if (!batch.empty())
+  {
+    fprintf(stderr, "batch: %ld of %ld tests run, %ld failed, %ld cycles\n",
+            batch_test + (batch_test < batch.size()), batch.size(), batch_failed, trace_count);
+    if (batch_results != stdout)
+      fclose(batch_results);
+    ret = batch_ret;
+  }
+  else if (cosim_failed)
+  {
+    fprintf(stderr, "*** FAILED *** (cosim, seed %d) after %ld cycles\n", random_seed, trace_count);
+    cosim->report(stderr);
+  }
+  else if (htif->exit_code())
   {
     fprintf(stderr, "*** FAILED *** (code = %d, seed %d) after %ld cycles\n", htif->exit_code(), random_seed, trace_count);
     ret = htif->exit_code();
@@ -244,6 +986,13 @@ int main(int argc, char** argv)
     fprintf(stderr, "Completed after %ld cycles\n", trace_count);
   }
 
+  if (cosim)
+  {
+    if (!cosim_failed)
+      fprintf(stderr, "cosim: %ld commits matched\n", cosim->commits());
+    delete cosim;
+  }
+
   delete htif;
 
   return ret;
@@ -0,0 +1,74 @@
+// See LICENSE for license details.
+
+#include "flight_recorder.h"
+#include <algorithm>
+#include <cassert>
+
+flight_recorder_t::flight_recorder_t(uint64_t cycles, size_t bytes)
+  : buf(bytes), written(0), cycle_starts(cycles), cycles_seen(0)
+{
+  assert(cycles > 0 && bytes > 0);
+  cookie_io_functions_t io = {NULL, write, NULL, NULL};
+  stream = fopencookie(this, "w", io);
+  setvbuf(stream, NULL, _IOFBF, 64 << 10);
+}
+
+flight_recorder_t::~flight_recorder_t()
+{
+  fclose(stream);
+}
+
+ssize_t flight_recorder_t::write(void* cookie, const char* data, size_t size)
+{
+  flight_recorder_t* fr = static_cast<flight_recorder_t*>(cookie);
+  size_t cap = fr->buf.size();
+
+  // only the last cap bytes of a huge write can survive anyway
+  const char* p = data + (size > cap ? size - cap : 0);
+  size_t n = std::min(size, cap);
+  fr->written += size - n;
+
+  while (n > 0) {
+    size_t offset = fr->written % cap;
+    size_t chunk = std::min(n, cap - offset);
+    std::copy(p, p + chunk, &fr->buf[offset]);
+    fr->written += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+  return size;
+}
+
+void flight_recorder_t::next_cycle()
+{
+  fflush(stream);
+  cycle_starts[cycles_seen % cycle_starts.size()] = written;
+  cycles_seen++;
+}
+
+void flight_recorder_t::dump(FILE* out)
+{
+  fflush(stream);
+  if (cycles_seen == 0)
+    return;
+
+  // start at the oldest retained cycle whose output hasn't been overwritten
+  size_t cap = buf.size();
+  uint64_t n = std::min<uint64_t>(cycles_seen, cycle_starts.size());
+  uint64_t from = written;
+  for (uint64_t c = cycles_seen - n; c < cycles_seen; c++) {
+    uint64_t start = cycle_starts[c % cycle_starts.size()];
+    if (written - start <= cap) {
+      from = start;
+      break;
+    }
+  }
+
+  for (uint64_t pos = from; pos < written; ) {
+    size_t offset = pos % cap;
+    size_t chunk = std::min<uint64_t>(written - pos, cap - offset);
+    fwrite(&buf[offset], 1, chunk, out);
+    pos += chunk;
+  }
+  fflush(out);
+}
@@ -0,0 +1,35 @@
+// See LICENSE for license details.
+
+#ifndef _FLIGHT_RECORDER_H
+#define _FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Keeps the trace output of the last few cycles in memory, so it can be
+// written out after the fact if the run fails.  Output is written to the
+// stdio stream returned by file(), and lands in a circular byte buffer;
+// next_cycle() marks where each cycle's output begins.  If the byte budget
+// runs out first, fewer than the requested number of cycles are retained.
+class flight_recorder_t
+{
+ public:
+  flight_recorder_t(uint64_t cycles, size_t bytes);
+  ~flight_recorder_t();
+
+  FILE* file() { return stream; }
+  void next_cycle();
+  void dump(FILE* out);
+
+ private:
+  static ssize_t write(void* cookie, const char* buf, size_t size);
+
+  FILE* stream;
+  std::vector<char> buf;
+  uint64_t written;                   // total bytes ever written
+  std::vector<uint64_t> cycle_starts; // ring of per-cycle starting offsets
+  uint64_t cycles_seen;
+};
+
+#endif
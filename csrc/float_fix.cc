@@ -1,9 +1,22 @@
+#include "float_fix.h"
+#include "commit_log.h"
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 // float_fix - Scott Beamer, 2015
@@ -19,114 +32,475 @@
 // only overwrite the log to hold the unrecoded float if that change will cause
 // it to match with the spike log (conservative).
 
+// With -j N, both logs are mapped into memory and split into record-aligned
+// ranges that are fixed on N threads; the output is still written in order.
+// Either log may also be a binary commit log (see commit_log.h), whose
+// records are compared field by field.  A line of a text log is only parsed
+// if it differs from its counterpart.
 
-// Returns the bits in x[high:low] in the lowest positions
-uint64_t BitRange(uint64_t x, int high, int low) {
-  int high_gap = 63 - high;
-  return x << high_gap >> (low + high_gap);
+
+// A text record is any line of a text log.  Is it the same line as the
+// other record?
+bool SameLine(const commit_rec_t& a, const commit_rec_t& b,
+              std::string* scratch) {
+  if ((a.kind == COMMIT_TEXT) == (b.kind == COMMIT_TEXT))
+    return commit_rec_equal(a, b);
+  const commit_rec_t& text = a.kind == COMMIT_TEXT ? a : b;
+  scratch->clear();
+  commit_rec_format(a.kind == COMMIT_TEXT ? b : a, scratch);
+  return scratch->size() == text.text_len &&
+         memcmp(scratch->data(), text.text, text.text_len) == 0;
 }
 
 
-// Returns uint64_t from the hex encoding within s offset by index
-uint64_t UIntFromHexSubstring(std::string s, int index) {
-  uint64_t x = strtoull(s.c_str() + index, nullptr, 16);
-  assert(errno == 0);
-  return x;
+// The fields of a record, parsing those of a text record
+bool RecordFields(const commit_rec_t& rec, commit_rec_t* fields) {
+  if (rec.kind != COMMIT_TEXT) {
+    *fields = rec;
+    return true;
+  }
+  return commit_rec_parse_fields(rec.text, rec.text_len, fields);
 }
 
 
-// Is commit line for a fld instruction?
-bool LineIsFLDInst(std::string line) {
-  uint32_t inst_bits = UIntFromHexSubstring(line, 22);
-  uint32_t width_field = (inst_bits >> 12) & 7;
-  uint32_t opcode_field = inst_bits & 127;
-  return (width_field == 3) && (opcode_field == 7);
+// Appends rocket to out as a line of text, unrecoded if that is what makes
+// it match lspike (NULL once the lspike log has ended)
+void FixAndAppend(const commit_rec_t& rocket, const commit_rec_t* lspike,
+                  std::string* scratch, std::string* out) {
+  commit_rec_t r, s, fixed;
+  if (lspike && !SameLine(rocket, *lspike, scratch) &&
+      RecordFields(rocket, &r) && RecordFields(*lspike, &s) &&
+      FixRecord(r, s, &fixed)) {
+    size_t start = out->size();
+    commit_rec_format(fixed, out);
+    // a text line has to match exactly, not just parse the same
+    if (lspike->kind != COMMIT_TEXT ||
+        (out->size() - start == lspike->text_len &&
+         memcmp(out->data() + start, lspike->text, lspike->text_len) == 0)) {
+      out->push_back('\n');
+      return;
+    }
+    out->resize(start);
+  }
+  commit_rec_format(rocket, out);
+  out->push_back('\n');
 }
 
 
-// Is number possibly a recoded float inside double (upper 31 bits set)?
-bool NestedFloatPossible(uint64_t raw_input) {
-  const uint64_t mask = 0xfffffffe00000000;
-  return (raw_input & mask) == mask;
-}
+// Reads a log one record at a time, each line of a text log being a text
+// record.  A record's text is valid until the next call.
+class LogReader {
+ public:
+  explicit LogReader(const std::string& filename)
+      : fd_(open(filename.c_str(), O_RDONLY)), buf_(1 << 20), pos_(0),
+        end_(0), eof_(false), binary_(false) {
+    if (fd_ < 0)
+      return;
+    while (end_ < sizeof(commit_log_magic) && Fill()) {}
+    binary_ = commit_log_is_binary(buf_.data(), end_);
+    if (binary_)
+      pos_ = sizeof(commit_log_magic);
+  }
+  ~LogReader() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
 
+  bool is_open() const { return fd_ >= 0; }
 
-// Unrecodes a single float within a double
-//   uses magic numbers since can only handle float
-//   logic from berkeley-hardfloat/src/main/scala/recodedFloatNToFloatN.scala
-uint64_t UnrecodeFloatFromDouble(uint64_t raw_input) {
-  uint64_t recoded_float = raw_input & 0x1ffffffff;  // lower 33 bits
-  uint64_t sign = BitRange(recoded_float, 32, 32);
-  uint64_t exp_in = BitRange(recoded_float, 31, 23);
-  uint64_t sig_in = BitRange(recoded_float, 22, 0);
-
-  bool is_high_subnormal_in = BitRange(exp_in, 6, 0) < 2;
-  bool is_subnormal = (BitRange(exp_in, 8, 6) == 1) ||
-                     ((BitRange(exp_in, 8, 7) == 1) && is_high_subnormal_in);
-  bool is_normal = (BitRange(exp_in, 8, 7) == 1) && !is_high_subnormal_in ||
-                   (BitRange(exp_in, 8, 7) == 2);
-  bool is_special = BitRange(exp_in, 8, 7) == 3;
-  bool is_NaN = is_special && BitRange(exp_in, 6, 6);
-
-  uint64_t denorm_shift_dist = 2 - BitRange(exp_in, 4, 0);
-  uint64_t subnormal_sig_out = (0x400000 | sig_in) >> denorm_shift_dist;
-  uint8_t normal_exp_out = BitRange(exp_in, 7, 0) - 129;
-
-  uint64_t exp_out = is_normal ? normal_exp_out : (is_special ? 255 : 0);
-  uint64_t sig_out = is_normal || is_NaN ? sig_in :
-                     is_subnormal ? subnormal_sig_out : 0;
-
-  uint64_t raw_output64 = (sign << 31) | (exp_out << 23) | sig_out;
-  // assert((raw_output64 & 0xffffffff00000000) == uint64_t(0));
-  // If this is not a recoded float, this will return gibberish, however,
-  // the output will not match spike and thus the replacement will not happen.
-  return raw_output64;
-}
+  bool Next(commit_rec_t* rec) {
+    while (true) {
+      if (binary_) {
+        if (size_t len = codec_.decode(&buf_[pos_], end_ - pos_, rec)) {
+          pos_ += len;
+          return true;
+        }
+      } else {
+        const void* nl = memchr(&buf_[pos_], '\n', end_ - pos_);
+        if (nl) {
+          size_t len = static_cast<const char*>(nl) - &buf_[pos_];
+          SetText(rec, len);
+          pos_ += len + 1;
+          return true;
+        }
+      }
+      if (!Fill()) {
+        if (pos_ == end_)
+          return false;
+        if (binary_) {
+          std::cout << "Truncated record at end of binary log" << std::endl;
+          std::exit(-2);
+        }
+        SetText(rec, end_ - pos_);  // final line has no newline
+        pos_ = end_;
+        return true;
+      }
+    }
+  }
+
+ private:
+  void SetText(commit_rec_t* rec, size_t len) {
+    rec->kind = COMMIT_TEXT;
+    rec->text = &buf_[pos_];
+    rec->text_len = len;
+  }
+
+  // Moves what is left to the front and reads more; false at end of file
+  bool Fill() {
+    if (eof_)
+      return false;
+    std::copy(buf_.begin() + pos_, buf_.begin() + end_, buf_.begin());
+    end_ -= pos_;
+    pos_ = 0;
+    if (end_ == buf_.size())
+      buf_.resize(2 * buf_.size());
+    ssize_t n = read(fd_, &buf_[end_], buf_.size() - end_);
+    if (n <= 0) {
+      eof_ = true;
+      return false;
+    }
+    end_ += n;
+    return true;
+  }
+
+  int fd_;
+  std::vector<char> buf_;
+  size_t pos_, end_;
+  bool eof_;
+  bool binary_;
+  commit_log_codec_t codec_;
+};
 
 
-// Best effort at replacing the float writeback with unrecoded version
-//   will only replace if (all of following met):
-//   - log lines differ between rocket and lspike
-//   - log line is a fld instruction
-//   - unrecoding the writeback data as a single float makes them match
 void DiffAndFix(std::string rocket_filename, std::string lspike_filename) {
   if (rocket_filename == "-")
     rocket_filename = "/dev/stdin";
-  std::ifstream rocket_log(rocket_filename);
+  LogReader rocket_log(rocket_filename);
   if (!rocket_log.is_open()) {
     std::cout << "Couldn't open file " << rocket_filename << std::endl;
     std::exit(-2);
   }
-  std::ifstream lspike_log(lspike_filename);
+  LogReader lspike_log(lspike_filename);
   if (!lspike_log.is_open()) {
     std::cout << "Couldn't open file " << lspike_filename << std::endl;
     std::exit(-2);
   }
-  std::string rocket_line, lspike_line;
-  while (getline(rocket_log, rocket_line)) {
-    if (getline(lspike_log, lspike_line) && (rocket_line != lspike_line) &&
-        LineIsFLDInst(rocket_line)) {
-      std::string fixed_line(rocket_line.c_str());  // deep copy
-      uint64_t raw_fp = UIntFromHexSubstring(fixed_line, 40);
-      if (NestedFloatPossible(raw_fp)) {
-        snprintf(const_cast<char*>(fixed_line.data()) + 40, 17,
-                 "%016" PRIx64, UnrecodeFloatFromDouble(raw_fp));
-        if (fixed_line == lspike_line)
-          rocket_line = fixed_line;
+  commit_rec_t rocket_rec, lspike_rec;
+  std::string line, scratch;
+  while (rocket_log.Next(&rocket_rec)) {
+    bool more = lspike_log.Next(&lspike_rec);
+    line.clear();
+    FixAndAppend(rocket_rec, more ? &lspike_rec : nullptr, &scratch, &line);
+    fwrite(line.data(), 1, line.size(), stdout);
+  }
+}
+
+
+// A read-only mapping of a whole log
+struct MappedLog {
+  std::string filename;
+  const char* data = nullptr;
+  size_t size = 0;
+  bool binary = false;
+};
+
+
+void MapLog(const std::string& filename, MappedLog* log) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cout << "Couldn't open file " << filename << std::endl;
+    std::exit(-2);
+  }
+  log->filename = filename;
+  log->size = st.st_size;
+  if (log->size != 0) {
+    void* p = mmap(nullptr, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      std::cout << "Couldn't map file " << filename << std::endl;
+      std::exit(-2);
+    }
+    madvise(p, log->size, MADV_SEQUENTIAL);
+    log->data = static_cast<const char*>(p);
+  }
+  close(fd);
+  log->binary = commit_log_is_binary(log->data, log->size);
+}
+
+
+// Finds the line at pos; sets len to its length excluding the newline and
+// returns where the next line starts
+inline size_t NextLine(const MappedLog& log, size_t pos, size_t* len) {
+  const void* nl = memchr(log.data + pos, '\n', log.size - pos);
+  size_t end = nl ? static_cast<const char*>(nl) - log.data : log.size;
+  *len = end - pos;
+  return nl ? end + 1 : end;
+}
+
+
+// A log split into ranges of whole records: where each starts (then the end
+// of the log), the number of lines before each (then the total), and for a
+// binary log the codec state at each start
+struct LogSplit {
+  std::vector<size_t> starts;
+  std::vector<size_t> lines_before;
+  std::vector<commit_log_codec_t> codecs;
+
+  size_t num_ranges() const { return starts.size() - 1; }
+};
+
+
+// Splits a text log into ranges of about chunk_bytes that each end just
+// after a newline (or at the end of the log).  The lines in each range are
+// counted later, in parallel.
+void SplitText(const MappedLog& log, size_t chunk_bytes, LogSplit* split) {
+  split->starts.push_back(0);
+  for (size_t pos = 0; log.size - pos > chunk_bytes;
+       split->starts.push_back(pos)) {
+    const char* from = log.data + pos + chunk_bytes - 1;
+    const void* nl = memchr(from, '\n', log.data + log.size - from);
+    if (!nl)
+      break;
+    pos = static_cast<const char*>(nl) - log.data + 1;
+    if (pos == log.size)
+      break;
+  }
+  split->starts.push_back(log.size);
+  split->lines_before.resize(split->starts.size());
+}
+
+
+// Number of lines in the range [begin, end) of a text log
+size_t CountLines(const MappedLog& log, size_t begin, size_t end) {
+  size_t n = std::count(log.data + begin, log.data + end, '\n');
+  return n + (end > begin && log.data[end-1] != '\n');  // no final newline
+}
+
+
+// Splits a binary log into ranges of about chunk_bytes.  Each record's pc
+// may depend on the records before it, so finding the boundaries takes one
+// pass decoding the records, but nothing is rendered.
+void SplitRecords(const MappedLog& log, size_t chunk_bytes, LogSplit* split) {
+  commit_log_codec_t codec;
+  commit_rec_t rec;
+  size_t pos = sizeof(commit_log_magic), range_start = pos, lines = 0;
+  split->starts.push_back(pos);
+  split->lines_before.push_back(0);
+  split->codecs.push_back(codec);
+  while (size_t len = codec.decode(log.data + pos, log.size - pos, &rec)) {
+    pos += len;
+    lines++;
+    if (pos - range_start >= chunk_bytes && pos != log.size) {
+      split->starts.push_back(pos);
+      split->lines_before.push_back(lines);
+      split->codecs.push_back(codec);
+      range_start = pos;
+    }
+  }
+  if (pos != log.size) {
+    std::cout << "Truncated record at end of " << log.filename << std::endl;
+    std::exit(-2);
+  }
+  split->starts.push_back(log.size);
+  split->lines_before.push_back(lines);
+}
+
+
+// Reads the records of a mapped log from the start of a range on
+class LogCursor {
+ public:
+  LogCursor(const MappedLog& log, const LogSplit& split, size_t range)
+      : log_(log), pos_(split.starts[range]) {
+    if (log.binary)
+      codec_ = split.codecs[range];
+  }
+
+  size_t pos() const { return pos_; }
+
+  bool Next(commit_rec_t* rec) {
+    if (pos_ >= log_.size)
+      return false;
+    if (log_.binary) {
+      // SplitRecords has checked that every record is complete
+      pos_ += codec_.decode(log_.data + pos_, log_.size - pos_, rec);
+    } else {
+      size_t len;
+      rec->kind = COMMIT_TEXT;
+      rec->text = log_.data + pos_;
+      pos_ = NextLine(log_, pos_, &len);
+      rec->text_len = len;
+    }
+    return true;
+  }
+
+  // Moves to the end of the log
+  void Finish() { pos_ = log_.size; }
+
+ private:
+  const MappedLog& log_;
+  size_t pos_;
+  commit_log_codec_t codec_;
+};
+
+
+// A cursor at line number `line`, or at the end if the log is shorter
+LogCursor CursorAtLine(const MappedLog& log, const LogSplit& split,
+                       size_t line) {
+  const std::vector<size_t>& before = split.lines_before;
+  size_t range = std::upper_bound(before.begin(), before.end() - 1, line) -
+                 before.begin() - 1;
+  LogCursor cursor(log, split, range);
+  commit_rec_t rec;
+  if (line >= before.back())
+    cursor.Finish();
+  else
+    for (size_t i = before[range]; i < line; i++)
+      cursor.Next(&rec);
+  return cursor;
+}
+
+
+// Fixes one range of the rocket log against the lspike records from lspike on
+void FixChunk(const MappedLog& rocket, const LogSplit& split, size_t range,
+              LogCursor lspike, std::string* out) {
+  LogCursor cursor(rocket, split, range);
+  commit_rec_t rocket_rec, lspike_rec;
+  std::string scratch;
+  while (cursor.pos() < split.starts[range+1] && cursor.Next(&rocket_rec)) {
+    bool more = lspike.Next(&lspike_rec);
+    FixAndAppend(rocket_rec, more ? &lspike_rec : nullptr, &scratch, out);
+  }
+}
+
+
+// Both logs are split into record-aligned byte ranges of about 1/N of the
+// log (at most kMaxChunkBytes, which bounds the buffered output).  The same
+// N threads first count the lines in every range of a text log, which gives
+// the line number each range starts at, then fix the rocket ranges, each
+// against the lspike records with the same numbers.  The main thread writes
+// the fixed ranges out in order; workers stay at most 2N ranges ahead of it.
+void ParallelDiffAndFix(std::string rocket_filename,
+                        std::string lspike_filename, int num_threads) {
+  MappedLog rocket, lspike;
+  MapLog(rocket_filename, &rocket);
+  MapLog(lspike_filename, &lspike);
+
+  const size_t kMaxChunkBytes = 16 << 20;
+  size_t chunk_bytes = std::max<size_t>(
+      1, std::min(kMaxChunkBytes, std::max(rocket.size, lspike.size) / num_threads));
+  LogSplit r_split, s_split;
+  std::vector<std::pair<const MappedLog*, LogSplit*> > logs = {
+      {&rocket, &r_split}, {&lspike, &s_split}};
+  // ranges of text logs, whose lines are still to be counted
+  std::vector<std::pair<size_t, size_t> > to_count;
+  for (size_t l = 0; l < logs.size(); l++) {
+    if (logs[l].first->binary) {
+      SplitRecords(*logs[l].first, chunk_bytes, logs[l].second);
+    } else {
+      SplitText(*logs[l].first, chunk_bytes, logs[l].second);
+      for (size_t i = 0; i < logs[l].second->num_ranges(); i++)
+        to_count.emplace_back(l, i);
+    }
+  }
+  size_t r_ranges = r_split.num_ranges();
+
+  std::atomic<size_t> next_count(0);
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t counted = 0;
+  bool numbered = false;
+  size_t next_fix = 0, written = 0;
+  const size_t window = 2 * num_threads;
+  std::vector<std::string> outputs(r_ranges);
+  std::vector<bool> done(r_ranges);
+
+  auto worker = [&]() {
+    for (size_t i; (i = next_count++) < to_count.size(); ) {
+      const MappedLog& log = *logs[to_count[i].first].first;
+      LogSplit* split = logs[to_count[i].first].second;
+      size_t range = to_count[i].second;
+      split->lines_before[range] =
+          CountLines(log, split->starts[range], split->starts[range+1]);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (++counted == to_count.size())
+        cv.notify_all();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return numbered; });
+    while (next_fix < r_ranges) {
+      size_t c = next_fix++;
+      cv.wait(lock, [&] { return c < written + window; });
+      lock.unlock();
+      std::string out;
+      FixChunk(rocket, r_split, c,
+               CursorAtLine(lspike, s_split, r_split.lines_before[c]), &out);
+      lock.lock();
+      outputs[c].swap(out);
+      done[c] = true;
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++)
+    workers.emplace_back(worker);
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return counted == to_count.size(); });
+    // turn the line counts of text logs into the lines before each range
+    for (auto& log : logs) {
+      if (log.first->binary)
+        continue;
+      size_t total = 0;
+      for (size_t& n : log.second->lines_before) {
+        size_t before = total;
+        total += n;
+        n = before;
       }
     }
-    printf("%s\n", rocket_line.c_str());
+    numbered = true;
+    cv.notify_all();
   }
-  rocket_log.close();
-  lspike_log.close();
+
+  for (size_t c = 0; c < r_ranges; c++) {
+    std::string out;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return done[c]; });
+      out.swap(outputs[c]);
+      written = c + 1;
+      cv.notify_all();
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+  }
+  for (std::thread& t : workers)
+    t.join();
+
+  if (rocket.data)
+    munmap(const_cast<char*>(rocket.data), rocket.size);
+  if (lspike.data)
+    munmap(const_cast<char*>(lspike.data), lspike.size);
 }
 
 
 int main(int argc, char** argv) {
+  int num_threads = 0;
+  if (argc == 5 && std::string(argv[1]) == "-j") {
+    num_threads = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
   if (argc != 3) {
-    std::cout << "Usage: float_fix rocket_output lspike_output" << std::endl;
+    std::cout << "Usage: float_fix [-j threads] rocket_output lspike_output"
+              << std::endl;
     return -1;
   }
-  DiffAndFix(std::string(argv[1]), std::string(argv[2]));
+  // stdin can't be mapped, so it is always streamed
+  if (num_threads > 0 && std::string(argv[1]) != "-")
+    ParallelDiffAndFix(std::string(argv[1]), std::string(argv[2]),
+                       num_threads);
+  else
+    DiffAndFix(std::string(argv[1]), std::string(argv[2]));
   return 0;
 }
@@ -0,0 +1,99 @@
+// See LICENSE for license details.
+
+#ifndef _FLOAT_FIX_H
+#define _FLOAT_FIX_H
+
+// The line fix-up behind float_fix (see float_fix.cc), kept in a header so
+// the emulator's +cosim checker can apply it in-process.
+
+#include "commit_log.h"
+#include <stdint.h>
+#include <string>
+
+
+// Returns the bits in x[high:low] in the lowest positions
+inline uint64_t BitRange(uint64_t x, int high, int low) {
+  int high_gap = 63 - high;
+  return x << high_gap >> (low + high_gap);
+}
+
+
+// Is the instruction a fld?
+inline bool InsnIsFLD(uint32_t inst_bits) {
+  uint32_t width_field = (inst_bits >> 12) & 7;
+  uint32_t opcode_field = inst_bits & 127;
+  return (width_field == 3) && (opcode_field == 7);
+}
+
+
+// Is number possibly a recoded float inside double (upper 31 bits set)?
+inline bool NestedFloatPossible(uint64_t raw_input) {
+  const uint64_t mask = 0xfffffffe00000000;
+  return (raw_input & mask) == mask;
+}
+
+
+// Unrecodes a single float within a double
+//   uses magic numbers since can only handle float
+//   logic from berkeley-hardfloat/src/main/scala/recodedFloatNToFloatN.scala
+inline uint64_t UnrecodeFloatFromDouble(uint64_t raw_input) {
+  uint64_t recoded_float = raw_input & 0x1ffffffff;  // lower 33 bits
+  uint64_t sign = BitRange(recoded_float, 32, 32);
+  uint64_t exp_in = BitRange(recoded_float, 31, 23);
+  uint64_t sig_in = BitRange(recoded_float, 22, 0);
+
+  bool is_high_subnormal_in = BitRange(exp_in, 6, 0) < 2;
+  bool is_subnormal = (BitRange(exp_in, 8, 6) == 1) ||
+                     ((BitRange(exp_in, 8, 7) == 1) && is_high_subnormal_in);
+  bool is_normal = ((BitRange(exp_in, 8, 7) == 1) && !is_high_subnormal_in) ||
+                   (BitRange(exp_in, 8, 7) == 2);
+  bool is_special = BitRange(exp_in, 8, 7) == 3;
+  bool is_NaN = is_special && BitRange(exp_in, 6, 6);
+
+  uint64_t denorm_shift_dist = 2 - BitRange(exp_in, 4, 0);
+  uint64_t subnormal_sig_out = (0x400000 | sig_in) >> denorm_shift_dist;
+  uint8_t normal_exp_out = BitRange(exp_in, 7, 0) - 129;
+
+  uint64_t exp_out = is_normal ? normal_exp_out : (is_special ? 255 : 0);
+  uint64_t sig_out = is_normal || is_NaN ? sig_in :
+                     is_subnormal ? subnormal_sig_out : 0;
+
+  uint64_t raw_output64 = (sign << 31) | (exp_out << 23) | sig_out;
+  // assert((raw_output64 & 0xffffffff00000000) == uint64_t(0));
+  // If this is not a recoded float, this will return gibberish, however,
+  // the output will not match spike and thus the replacement will not happen.
+  return raw_output64;
+}
+
+
+// Best effort at replacing the float writeback with unrecoded version
+//   will only replace if (all of following met):
+//   - commits differ between rocket and lspike
+//   - commit is a fld instruction with its writeback
+//   - unrecoding the writeback data as a single float makes them match
+// Returns true and leaves the replacement in fixed if so
+inline bool FixRecord(const commit_rec_t& rocket, const commit_rec_t& lspike,
+                      commit_rec_t* fixed) {
+  if (rocket.kind != COMMIT_INSN_RD || !InsnIsFLD(rocket.insn) ||
+      !NestedFloatPossible(rocket.data) || commit_rec_equal(rocket, lspike))
+    return false;
+  *fixed = rocket;
+  fixed->data = UnrecodeFloatFromDouble(rocket.data);
+  return commit_rec_equal(*fixed, lspike);
+}
+
+
+// FixRecord on two lines of text; the replacement is left in fixed_line
+inline bool FixLine(const std::string& rocket_line,
+                    const std::string& lspike_line, std::string* fixed_line) {
+  commit_rec_t rocket, lspike, fixed;
+  if (!commit_rec_parse_fields(rocket_line.data(), rocket_line.size(), &rocket) ||
+      !commit_rec_parse_fields(lspike_line.data(), lspike_line.size(), &lspike) ||
+      !FixRecord(rocket, lspike, &fixed))
+    return false;
+  fixed_line->clear();
+  commit_rec_format(fixed, fixed_line);
+  return *fixed_line == lspike_line;
+}
+
+#endif
@@ -4,22 +4,206 @@
 #define _HTIF_EMULATOR_H
 
 #include <fesvr/htif_pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <vector>
 
+// Follows the packet framing on one direction of the HTIF link: a 64-bit
+// header holding the command and the payload size in 64-bit words, then
+// the payload.  Requests only carry a payload for writes; responses always
+// carry the number of words given in their header.
+class htif_stream_t
+{
+ public:
+  htif_stream_t(bool requests)
+    : packets(0), mem_packets(0), requests(requests), header(0), header_bytes(0), payload_bytes(0) {}
+
+  void consume(const void* buf, size_t size)
+  {
+    const uint8_t* p = (const uint8_t*)buf;
+    for (size_t i = 0; i < size; ) {
+      if (payload_bytes) {
+        size_t n = std::min<uint64_t>(payload_bytes, size - i);
+        payload_bytes -= n;
+        i += n;
+        if (payload_bytes == 0)
+          packets++;
+        continue;
+      }
+
+      header |= uint64_t(p[i++]) << (8 * header_bytes);
+      if (++header_bytes == sizeof(header)) {
+        uint64_t cmd = header & 0xf, words = (header >> 4) & 0xfff;
+        bool has_payload = !requests || cmd == cmd_write_mem || cmd == cmd_write_cr;
+        if (cmd == cmd_read_mem || cmd == cmd_write_mem)
+          mem_packets++;
+        payload_bytes = has_payload ? words * 8 : 0;
+        header = 0;
+        header_bytes = 0;
+        if (payload_bytes == 0)
+          packets++;
+      }
+    }
+  }
+
+  bool in_packet() const { return header_bytes != 0 || payload_bytes != 0; }
+
+  uint64_t packets;
+  uint64_t mem_packets;
+
+ private:
+  static const uint64_t cmd_read_mem = 0;
+  static const uint64_t cmd_write_mem = 1;
+  static const uint64_t cmd_write_cr = 3;
+
+  bool requests;
+  uint64_t header;
+  size_t header_bytes;
+  uint64_t payload_bytes;
+};
+
+// Bytes from the fesvr thread to the target.  Single producer, single
+// consumer: the host only advances tail and the target only head.  A push
+// that doesn't fit doubles the ring.  That is safe because htif_pthread_t
+// only ever runs one of fesvr and the target at a time, handing control
+// back and forth, which its own queues already depend on.
+class htif_ring_t
+{
+ public:
+  htif_ring_t(size_t capacity) : buf(capacity), head(0), tail(0)
+  {
+    assert((capacity & (capacity-1)) == 0);
+  }
+
+  size_t size() const
+  {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+  }
+
+  void push(const void* src, size_t n)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    if (t + n - h > buf.size())
+      grow(h, t, t + n - h);
+    for (size_t i = 0; i < n; i++)
+      buf[(t + i) & (buf.size() - 1)] = ((const char*)src)[i];
+    tail.store(t + n, std::memory_order_release);
+  }
+
+  void pop(void* dst, size_t n)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < n; i++)
+      ((char*)dst)[i] = buf[(h + i) & (buf.size() - 1)];
+    head.store(h + n, std::memory_order_release);
+  }
+
+ private:
+  // Resize to hold at least need bytes, keeping the unread bytes [h, t) at
+  // the same (absolute) positions
+  void grow(size_t h, size_t t, size_t need)
+  {
+    size_t capacity = buf.size();
+    while (capacity < need)
+      capacity *= 2;
+    std::vector<char> bigger(capacity);
+    for (size_t i = h; i != t; i++)
+      bigger[i & (capacity - 1)] = buf[i & (buf.size() - 1)];
+    buf.swap(bigger);
+  }
+
+  std::vector<char> buf;
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+};
+
+// htif_pthread_t hands bytes across the link a chunk at a time and
+// switches to the fesvr thread on every poll that finds nothing to read,
+// even when fesvr is itself only waiting on the target.  Here the host's
+// writes land in a ring the target drains without switching, the
+// target's bytes go across a whole packet at a time, and the target only
+// yields to fesvr when fesvr can make progress: it isn't blocked reading,
+// or a packet has just been handed to it.
 class htif_emulator_t : public htif_pthread_t
 {
  int memory_channel_mux_select;
+ bool restored;
+ htif_stream_t to_target;
+ htif_stream_t from_target;
+
+ htif_ring_t to_target_ring;
+ std::vector<char> from_target_packet;
+ std::atomic<bool> host_blocked;
+ bool host_has_packet;
 
  public:
   htif_emulator_t(const std::vector<std::string>& args)
     : htif_pthread_t(args),
-      memory_channel_mux_select(0)
+      memory_channel_mux_select(0),
+      restored(false),
+      to_target(true),
+      from_target(false),
+      to_target_ring(1 << 16),
+      host_blocked(false),
+      host_has_packet(false)
   {
     for (const auto& arg: args) {
       if (!strncmp(arg.c_str(), "+memory_channel_mux_select=", 27))
         memory_channel_mux_select = atoi(arg.c_str()+27);
+      else if (!strncmp(arg.c_str(), "+restore=", 9))
+        restored = true;
     }
  }
 
+  bool recv_nonblocking(void* buf, size_t size)
+  {
+    if (to_target_ring.size() < size)
+    {
+      // Nothing ever reaches the base class's own queue, so this just
+      // switches to fesvr and comes back empty-handed
+      if (!host_blocked || host_has_packet)
+      {
+        host_has_packet = false;
+        htif_pthread_t::recv_nonblocking(buf, size);
+      }
+      return false;
+    }
+    to_target_ring.pop(buf, size);
+    to_target.consume(buf, size);
+    return true;
+  }
+
+  void send(const void* buf, size_t size)
+  {
+    from_target.consume(buf, size);
+    from_target_packet.insert(from_target_packet.end(), (const char*)buf, (const char*)buf + size);
+    if (!from_target.in_packet())
+    {
+      htif_pthread_t::send(&from_target_packet[0], from_target_packet.size());
+      from_target_packet.clear();
+      host_has_packet = true;
+    }
+  }
+
+  // Number of target memory accesses the host has requested.  Outside of
+  // program loading, fesvr only touches target memory to serve syscalls, so
+  // this is a cheap indicator of host/target interaction.
+  uint64_t mem_requests() { return to_target.mem_packets; }
+
+  // Number of requests the host has sent the target, of any kind
+  uint64_t requests() { return to_target.packets; }
+
+  // True when no packet is partway across the link and every request handed
+  // to the target has been answered, so the target side of the link can be
+  // checkpointed.
+  bool link_idle()
+  {
+    return !to_target.in_packet() && !from_target.in_packet() &&
+           to_target.packets == from_target.packets;
+  }
+
   void set_clock_divisor(int divisor, int hold_cycles)
   {
 #ifdef UNCORE_SCR__HTIF_IO_CLOCK_DIVISOR__OFFSET
@@ -29,8 +213,29 @@ class htif_emulator_t : public htif_pthread_t
 #endif
   }
 
+  // The fesvr side of the link
+ protected:
+  ssize_t write(const void* buf, size_t size)
+  {
+    to_target_ring.push(buf, size);
+    return size;
+  }
+
+  ssize_t read(void* buf, size_t max_size)
+  {
+    host_blocked = true;
+    ssize_t n = htif_pthread_t::read(buf, max_size);
+    host_blocked = false;
+    return n;
+  }
+
+ public:
   void start()
   {
+    // A target restored from a checkpoint is already loaded, configured and
+    // out of reset; the host just resumes polling it.
+    if (restored)
+      return;
     set_clock_divisor(5, 2);
     htif_pthread_t::start();
   }
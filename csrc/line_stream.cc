@@ -0,0 +1,43 @@
+// See LICENSE for license details.
+
+#include "line_stream.h"
+#include <string.h>
+
+line_stream_t::line_stream_t(line_fn_t fn)
+  : fn(fn)
+{
+  cookie_io_functions_t io = {NULL, write, NULL, NULL};
+  stream = fopencookie(this, "w", io);
+  setvbuf(stream, NULL, _IOFBF, 64 << 10);
+}
+
+line_stream_t::~line_stream_t()
+{
+  fclose(stream);
+}
+
+ssize_t line_stream_t::write(void* cookie, const char* buf, size_t size)
+{
+  line_stream_t* ls = static_cast<line_stream_t*>(cookie);
+  const char* end = buf + size;
+
+  while (buf < end)
+  {
+    const char* nl = (const char*)memchr(buf, '\n', end - buf);
+    if (!nl)
+    {
+      ls->partial.append(buf, end);
+      break;
+    }
+    if (ls->partial.empty())
+      ls->fn(buf, nl - buf);
+    else
+    {
+      ls->partial.append(buf, nl);
+      ls->fn(ls->partial.data(), ls->partial.size());
+      ls->partial.clear();
+    }
+    buf = nl + 1;
+  }
+  return size;
+}
@@ -0,0 +1,34 @@
+// See LICENSE for license details.
+
+#ifndef _LINE_STREAM_H
+#define _LINE_STREAM_H
+
+#include <stdio.h>
+#include <functional>
+#include <string>
+
+// A stdio stream that hands each complete line written to it (without its
+// newline) to a callback.  Lines are passed straight out of the stdio buffer;
+// only a line split across buffer flushes is copied.  Call flush() to see
+// everything written so far.  A final line with no newline is never passed
+// on.
+class line_stream_t
+{
+ public:
+  typedef std::function<void(const char* str, size_t len)> line_fn_t;
+
+  line_stream_t(line_fn_t fn);
+  ~line_stream_t();
+
+  FILE* file() { return stream; }
+  void flush() { fflush(stream); }
+
+ private:
+  static ssize_t write(void* cookie, const char* buf, size_t size);
+
+  FILE* stream;
+  line_fn_t fn;
+  std::string partial;                // an incomplete line
+};
+
+#endif
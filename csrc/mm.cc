@@ -1,31 +1,104 @@
 // See LICENSE for license details.
 
 #include "mm.h"
+#include "checkpoint.h"
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <cstddef>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// A mask of the low bits bits
+static inline uint64_t low_bits(uint64_t bits)
+{
+  return bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+}
+
+// Spread the low 8 strobe bits into a mask with 0xff in each byte whose
+// bit is set: replicate the byte, isolate bit i in byte i, then carry each
+// set bit up into its byte's top bit.
+static inline uint64_t strb_byte_mask(uint64_t strb)
+{
+  uint64_t x = ((strb & 0xff) * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+  x = ((x + 0x7f7f7f7f7f7f7f7fULL) & 0x8080808080808080ULL) >> 7;
+  return x * 0xff;
+}
+
+// Store the bytes of data selected by strb into dst.  Wide words go
+// through a vector blend when the host allows it; the rest take eight
+// bytes at a time.
+static void write_masked(uint8_t *dst, const uint8_t *src, uint64_t strb, int n)
+{
+  int i = 0;
+#if defined(__AVX512BW__)
+  // Masked-out bytes are neither loaded nor stored, so this covers any
+  // word up to 64 bytes in one go
+  __mmask64 k = strb & low_bits(n);
+  _mm512_mask_storeu_epi8(dst, k, _mm512_maskz_loadu_epi8(k, src));
+  return;
+#elif defined(__AVX2__)
+  const __m256i spread = _mm256_setr_epi8(
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i bit = _mm256_set1_epi64x(0x8040201008040201ULL);
+  for (; i + 32 <= n; i += 32, strb >>= 32) {
+    __m256i m = _mm256_shuffle_epi8(_mm256_set1_epi32(uint32_t(strb)), spread);
+    m = _mm256_cmpeq_epi8(_mm256_and_si256(m, bit), bit);
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(d, s, m));
+  }
+#endif
+#if defined(__SSE2__) && !defined(__AVX512BW__)
+  for (; i + 16 <= n; i += 16, strb >>= 16) {
+    __m128i m = _mm_set_epi64x(strb_byte_mask(strb >> 8), strb_byte_mask(strb));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d)));
+  }
+#endif
+  for (; i + 8 <= n; i += 8, strb >>= 8) {
+    uint64_t m = strb_byte_mask(strb), d, s;
+    memcpy(&d, dst + i, 8);
+    memcpy(&s, src + i, 8);
+    d = (d & ~m) | (s & m);
+    memcpy(dst + i, &d, 8);
+  }
+  for (; i < n; i++, strb >>= 1)
+    if (strb & 1)
+      dst[i] = src[i];
+}
 
 void mm_t::write(uint64_t addr, uint8_t *data, uint64_t strb, uint64_t size)
 {
-  strb &= ((1 << size) - 1) << (addr % word_size);
+  strb &= low_bits(size) << (addr % word_size);
+  strb &= low_bits(word_size);
   addr %= this->size;
 
   uint8_t *base = this->data + (addr / word_size) * word_size;
-  for (int i = 0; i < word_size; i++) {
-    if (strb & 1)
-      base[i] = data[i];
-    strb >>= 1;
-  }
+  if (strb == low_bits(word_size))
+    memcpy(base, data, word_size);
+  else if (strb)
+    write_masked(base, data, strb, word_size);
 }
 
-std::vector<char> mm_t::read(uint64_t addr)
+void *mm_t::read(uint64_t addr)
 {
   addr %= this->size;
-
-  uint8_t *base = this->data + addr;
-  return std::vector<char>(base, base + word_size);
+  return this->data + addr;
 }
 
 void mm_t::init(size_t sz, int wsz, int lsz)
@@ -33,19 +106,161 @@ void mm_t::init(size_t sz, int wsz, int lsz)
   assert(wsz > 0 && lsz > 0 && (lsz & (lsz-1)) == 0 && lsz % wsz == 0);
   word_size = wsz;
   line_size = lsz;
-  data = new uint8_t[sz];
+
+  // Back target memory with an anonymous mapping rather than the heap, so
+  // host pages are only committed (zero-filled) when the target touches
+  // them.  MAP_NORESERVE keeps large +memsize configs from being charged
+  // against the host's commit limit up front.
+  void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+  data = (uint8_t *) p;
   size = sz;
 }
 
+// Memory images are checkpointed in fixed-size pages, skipping pages that
+// are all zero.  Every page is compared, rather than only those mincore()
+// reports resident, since a dirty page may have been swapped out.
+static const size_t ckpt_page_size = 4096;
+static const uint64_t ckpt_end_of_pages = UINT64_MAX;
+
+void mm_t::save(FILE* f)
+{
+  ckpt_put<uint64_t>(f, size);
+  ckpt_put<uint64_t>(f, word_size);
+  ckpt_put<uint64_t>(f, line_size);
+
+  size_t npages = (size + ckpt_page_size - 1) / ckpt_page_size;
+  static const uint8_t zeros[ckpt_page_size] = {0};
+  for (size_t i = 0; i < npages; i++) {
+    uint64_t offset = i * ckpt_page_size;
+    size_t len = std::min(ckpt_page_size, size - offset);
+    if (memcmp(data + offset, zeros, len) == 0)
+      continue;
+    ckpt_put<uint64_t>(f, i);
+    ckpt_write(f, data + offset, len);
+  }
+  ckpt_put<uint64_t>(f, ckpt_end_of_pages);
+}
+
+void mm_t::restore(FILE* f)
+{
+  uint64_t sz = ckpt_get<uint64_t>(f);
+  uint64_t wsz = ckpt_get<uint64_t>(f);
+  uint64_t lsz = ckpt_get<uint64_t>(f);
+  if (sz != size || wsz != (uint64_t) word_size || lsz != (uint64_t) line_size)
+  {
+    fprintf(stderr, "checkpoint memory geometry (%ld bytes, %ld/%ld byte words/lines) "
+            "does not match this emulator; check +memsize\n", sz, wsz, lsz);
+    exit(-1);
+  }
+
+  // Pages left out of the checkpoint were zero, whatever is loaded now
+  mm_t::reset();
+  for (uint64_t i; (i = ckpt_get<uint64_t>(f)) != ckpt_end_of_pages; ) {
+    uint64_t offset = i * ckpt_page_size;
+    assert(offset < size);
+    ckpt_read(f, data + offset, std::min(ckpt_page_size, size - offset));
+  }
+}
+
+void mm_t::map_image(int fd, off_t offset, size_t len)
+{
+  assert(len <= size && len % sysconf(_SC_PAGESIZE) == 0);
+  if (len == 0)
+    return;
+  void *p = mmap(data, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+  if (p == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(-1);
+  }
+}
+
+void mm_t::reset()
+{
+  // A fresh anonymous mapping over the old one releases exactly the pages
+  // that were committed (including any copy-on-write image), where zeroing
+  // would touch all of memory.
+  void *p = mmap(data, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(-1);
+  }
+}
+
 mm_t::~mm_t()
 {
-  delete [] data;
+  if (data)
+    munmap(data, size);
+}
+
+void mm_rresp_queue_t::init(size_t bsz, size_t capacity)
+{
+  assert(capacity > 0 && (capacity & (capacity-1)) == 0);
+  beat_size = bsz;
+  head = 0;
+  count = 0;
+  beats.resize(capacity);
+  storage.resize(capacity * beat_size);
+}
+
+void mm_rresp_queue_t::push(uint64_t id, const void *data, bool last)
+{
+  if (count == beats.size())
+    grow();
+
+  size_t tail = (head + count) & (beats.size() - 1);
+  beats[tail] = mm_rresp_t(id, last);
+  memcpy(&storage[tail * beat_size], data, beat_size);
+  count++;
+}
+
+void mm_rresp_queue_t::grow()
+{
+  // unwrap the ring into the bottom half of the doubled buffers
+  std::vector<mm_rresp_t> new_beats(beats.size() * 2);
+  std::vector<char> new_storage(storage.size() * 2);
+  for (size_t i = 0; i < count; i++) {
+    size_t j = (head + i) & (beats.size() - 1);
+    new_beats[i] = beats[j];
+    memcpy(&new_storage[i * beat_size], &storage[j * beat_size], beat_size);
+  }
+  beats.swap(new_beats);
+  storage.swap(new_storage);
+  head = 0;
+}
+
+void mm_rresp_queue_t::save(FILE* f)
+{
+  ckpt_put<uint64_t>(f, count);
+  for (size_t i = 0; i < count; i++) {
+    size_t j = (head + i) & (beats.size() - 1);
+    ckpt_put(f, beats[j]);
+    ckpt_write(f, &storage[j * beat_size], beat_size);
+  }
+}
+
+void mm_rresp_queue_t::restore(FILE* f)
+{
+  head = 0;
+  count = 0;
+  std::vector<char> dat(beat_size);
+  for (uint64_t n = ckpt_get<uint64_t>(f); n > 0; n--) {
+    mm_rresp_t beat = ckpt_get<mm_rresp_t>(f);
+    ckpt_read(f, &dat[0], beat_size);
+    push(beat.id, &dat[0], beat.last);
+  }
 }
 
 void mm_magic_t::init(size_t sz, int wsz, int lsz)
 {
   mm_t::init(sz, wsz, lsz);
   dummy_data.resize(word_size);
+  rresp.init(word_size);
 }
 
 void mm_magic_t::tick(
@@ -77,10 +292,8 @@ void mm_magic_t::tick(
 
   if (ar_fire) {
     uint64_t start_addr = (ar_addr / word_size) * word_size;
-    for (int i = 0; i <= ar_len; i++) {
-      auto dat = read(start_addr + i * word_size);
-      rresp.push(mm_rresp_t(ar_id, dat, i == ar_len));
-    }
+    for (int i = 0; i <= ar_len; i++)
+      rresp.push(ar_id, read(start_addr + i * word_size), i == ar_len);
   }
 
   if (aw_fire) {
@@ -112,7 +325,61 @@ void mm_magic_t::tick(
   cycle++;
 }
 
-void load_mem(void** mems, const char* fn, int line_size, int nchannels)
+void mm_magic_t::reset()
+{
+  mm_t::reset();
+  store_inflight = false;
+  bresp = std::queue<uint64_t>();
+  rresp.clear();
+}
+
+void mm_magic_t::save(FILE* f)
+{
+  mm_t::save(f);
+  ckpt_put(f, cycle);
+  ckpt_put(f, store_inflight);
+  ckpt_put(f, store_addr);
+  ckpt_put(f, store_id);
+  ckpt_put(f, store_size);
+  ckpt_put(f, store_count);
+
+  std::queue<uint64_t> b = bresp;
+  ckpt_put<uint64_t>(f, b.size());
+  for (; !b.empty(); b.pop())
+    ckpt_put(f, b.front());
+  rresp.save(f);
+}
+
+void mm_magic_t::restore(FILE* f)
+{
+  mm_t::restore(f);
+  cycle = ckpt_get<uint64_t>(f);
+  store_inflight = ckpt_get<bool>(f);
+  store_addr = ckpt_get<uint64_t>(f);
+  store_id = ckpt_get<uint64_t>(f);
+  store_size = ckpt_get<uint64_t>(f);
+  store_count = ckpt_get<uint64_t>(f);
+
+  bresp = std::queue<uint64_t>();
+  for (uint64_t n = ckpt_get<uint64_t>(f); n > 0; n--)
+    bresp.push(ckpt_get<uint64_t>(f));
+  rresp.restore(f);
+}
+
+// Exit unless the len bytes at image offset addr fit in the mem_bytes of
+// memory across all channels
+static void check_image_fits(const char* fn, uint64_t addr, uint64_t len, uint64_t mem_bytes)
+{
+  if (addr > mem_bytes || len > mem_bytes - addr)
+  {
+    fprintf(stderr, "%s: %ld bytes at offset 0x%lx don't fit in %ld bytes of memory; "
+            "check +memsize\n", fn, len, addr, mem_bytes);
+    exit(-1);
+  }
+}
+
+static uint64_t load_mem_hex(void** mems, const char* fn, int line_size, int nchannels,
+                             size_t channel_size)
 {
   char* m;
   ssize_t start = 0;
@@ -126,6 +393,7 @@ void load_mem(void** mems, const char* fn, int line_size, int nchannels)
   std::string line;
   while (std::getline(in, line))
   {
+    check_image_fits(fn, start, line.length()/2, channel_size * nchannels);
     #define parse_nibble(c) ((c) >= 'a' ? (c)-'a'+10 : (c)-'0')
     for (ssize_t i = line.length()-2, j = 0; i >= 0; i -= 2, j++) {
       char data = (parse_nibble(line[i]) << 4) | parse_nibble(line[i+1]);
@@ -137,4 +405,262 @@ void load_mem(void** mems, const char* fn, int line_size, int nchannels)
     }
     start += line.length()/2;
   }
+  return start;
+}
+
+// Copy len bytes of image, starting at image offset addr, into the
+// per-channel buffers one cache line (or part of a line) at a time.
+static void load_mem_block(void** mems, uint64_t addr, const uint8_t* src,
+                           size_t len, int line_size, int nchannels)
+{
+  while (len > 0) {
+    size_t offset = addr % line_size;
+    size_t n = std::min(len, line_size - offset);
+    int channel = (addr / line_size) % nchannels;
+    uint64_t dst = (addr / line_size / nchannels) * line_size + offset;
+    memcpy((char *) mems[channel] + dst, src, n);
+    addr += n;
+    src += n;
+    len -= n;
+  }
+}
+
+template <class ehdr_t, class phdr_t>
+static uint64_t load_mem_elf(void** mems, const char* fn, const uint8_t* image, size_t size,
+                         int line_size, int nchannels, uint64_t mem_base, size_t channel_size)
+{
+  const ehdr_t* eh = (const ehdr_t*) image;
+  if (size < sizeof(ehdr_t) || eh->e_phoff > size ||
+      eh->e_phnum > (size - eh->e_phoff) / sizeof(phdr_t))
+  {
+    fprintf(stderr, "%s: truncated ELF header\n", fn);
+    exit(-1);
+  }
+  const phdr_t* ph = (const phdr_t*) (image + eh->e_phoff);
+  uint64_t end = 0;
+  for (int i = 0; i < eh->e_phnum; i++) {
+    // bss (p_memsz > p_filesz) is already zero in freshly mapped memory
+    if (ph[i].p_type != PT_LOAD || ph[i].p_filesz == 0)
+      continue;
+    if (ph[i].p_offset > size || ph[i].p_filesz > size - ph[i].p_offset)
+    {
+      fprintf(stderr, "%s: segment %d lies outside the file\n", fn, i);
+      exit(-1);
+    }
+    if (ph[i].p_paddr < mem_base)
+    {
+      fprintf(stderr, "%s: segment %d at 0x%lx lies below memory at 0x%lx\n",
+              fn, i, uint64_t(ph[i].p_paddr), mem_base);
+      exit(-1);
+    }
+    check_image_fits(fn, ph[i].p_paddr - mem_base, ph[i].p_filesz, channel_size * nchannels);
+    load_mem_block(mems, ph[i].p_paddr - mem_base, image + ph[i].p_offset,
+                   ph[i].p_filesz, line_size, nchannels);
+    end = std::max<uint64_t>(end, ph[i].p_paddr - mem_base + ph[i].p_filesz);
+  }
+  return end;
+}
+
+// Images named *.hex are parsed as hex, one line per memory word.  Anything
+// else is mapped and block-copied: ELF files by their loadable segments
+// (placed at p_paddr - mem_base), other files as a raw binary image of
+// memory starting at offset 0.
+uint64_t load_mem(void** mems, const char* fn, int line_size, int nchannels, uint64_t mem_base,
+                  size_t channel_size)
+{
+  size_t fn_len = strlen(fn);
+  if (fn_len >= 4 && strcmp(fn + fn_len - 4, ".hex") == 0)
+    return load_mem_hex(mems, fn, line_size, nchannels, channel_size);
+
+  int fd = open(fn, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    std::cerr << "could not open " << fn << std::endl;
+    exit(-1);
+  }
+
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    std::cerr << "could not map " << fn << std::endl;
+    exit(-1);
+  }
+  madvise(p, size, MADV_SEQUENTIAL);
+  const uint8_t* image = (const uint8_t*) p;
+
+  uint64_t end = size;
+  if (size >= EI_NIDENT && memcmp(image, ELFMAG, SELFMAG) == 0) {
+    if (image[EI_CLASS] == ELFCLASS64)
+      end = load_mem_elf<Elf64_Ehdr, Elf64_Phdr>(mems, fn, image, size, line_size, nchannels,
+                                                 mem_base, channel_size);
+    else
+      end = load_mem_elf<Elf32_Ehdr, Elf32_Phdr>(mems, fn, image, size, line_size, nchannels,
+                                                 mem_base, channel_size);
+  } else {
+    check_image_fits(fn, 0, size, channel_size * nchannels);
+    load_mem_block(mems, 0, image, size, line_size, nchannels);
+  }
+
+  munmap(p, size);
+  close(fd);
+  return end;
+}
+
+// A cache entry holds load_mem's result for one image and memory geometry:
+// a header page, then each channel's memory up to the end of the last page
+// the image touched in any channel.  Pages the image left untouched are
+// holes in the file.  Entries are named by a hash of the image, how it is
+// loaded and the geometry, and are written under a temporary name and
+// renamed into place, so concurrent runs never see a partial entry.  A hit
+// is taken on the 64-bit (non-cryptographic) hash and the image size alone:
+// two images that collide are not told apart.  Delete the cache directory's
+// entries if that is a concern.
+struct mem_cache_header_t
+{
+  char magic[8];
+  uint64_t format;  // 'h'ex or 'b'inary (ELF or raw)
+  uint64_t image_size;
+  uint64_t image_hash;
+  uint64_t line_size;
+  uint64_t nchannels;
+  uint64_t mem_base;
+  uint64_t data_offset;
+  uint64_t channel_bytes;
+};
+
+static const char mem_cache_magic[8] = "rmemc03";
+
+static uint64_t hash_image(const uint8_t* p, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static bool map_mem_cache(mm_t** mms, int nchannels, const char* path,
+                          const mem_cache_header_t& want)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  mem_cache_header_t hdr;
+  struct stat st;
+  bool ok = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && fstat(fd, &st) == 0 &&
+            memcmp(&hdr, &want, offsetof(mem_cache_header_t, channel_bytes)) == 0 &&
+            st.st_size >= off_t(hdr.data_offset + nchannels * hdr.channel_bytes) &&
+            hdr.channel_bytes <= mms[0]->get_size();
+  if (ok)
+    for (int i = 0; i < nchannels; i++)
+      mms[i]->map_image(fd, hdr.data_offset + i * hdr.channel_bytes, hdr.channel_bytes);
+  close(fd);
+  return ok;
+}
+
+// image_end is the end of the highest image offset load_mem wrote: image
+// bytes [0, image_end) land below the same line in every channel, so pages
+// past it are zero and the rest are saved unless they read as zero.
+static void write_mem_cache(mm_t** mms, int nchannels, const char* path,
+                            mem_cache_header_t hdr, uint64_t image_end)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  uint64_t line_size = hdr.line_size;
+  uint64_t end = image_end ? ((image_end - 1) / (line_size * nchannels) + 1) * line_size : 0;
+  size_t extent = std::min<uint64_t>((end + page - 1) / page, mms[0]->get_size() / page);
+  std::vector<uint8_t> zeros(page);
+  hdr.channel_bytes = extent * page;
+
+  std::string tmp = std::string(path) + ".tmp." + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0 && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+  for (int i = 0; ok && i < nchannels; i++) {
+    const uint8_t* mem = (const uint8_t*) mms[i]->get_data();
+    for (size_t j = 0; ok && j < extent; j++)
+      if (memcmp(mem + j * page, &zeros[0], page) != 0)
+        ok = pwrite(fd, mem + j * page, page,
+                    hdr.data_offset + i * hdr.channel_bytes + j * page) == ssize_t(page);
+  }
+  ok = ok && ftruncate(fd, hdr.data_offset + nchannels * hdr.channel_bytes) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    std::cerr << "warning: could not write memory image cache " << path << std::endl;
+    unlink(tmp.c_str());
+  }
+}
+
+void load_mem_cached(mm_t** mms, const char* fn, int line_size, int nchannels,
+                     uint64_t mem_base, const char* cache_dir)
+{
+  void* mems[nchannels];
+  for (int i = 0; i < nchannels; i++)
+    mems[i] = mms[i]->get_data();
+
+  int fd = open(fn, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    std::cerr << "could not open " << fn << std::endl;
+    exit(-1);
+  }
+
+  mem_cache_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, mem_cache_magic, sizeof(hdr.magic));
+  size_t fn_len = strlen(fn);
+  hdr.format = fn_len >= 4 && strcmp(fn + fn_len - 4, ".hex") == 0 ? 'h' : 'b';
+  hdr.image_size = st.st_size;
+  hdr.line_size = line_size;
+  hdr.nchannels = nchannels;
+  hdr.mem_base = mem_base;
+  hdr.data_offset = std::max<size_t>(sysconf(_SC_PAGESIZE), sizeof(hdr));
+  if (st.st_size > 0)
+  {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      std::cerr << "could not map " << fn << std::endl;
+      exit(-1);
+    }
+    hdr.image_hash = hash_image((const uint8_t*) p, st.st_size);
+    munmap(p, st.st_size);
+  }
+  close(fd);
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%016lx-%lx-%c-%d-%d-%lx.img", cache_dir,
+           hdr.image_hash, hdr.image_size, char(hdr.format), line_size, nchannels, mem_base);
+  if (map_mem_cache(mms, nchannels, path, hdr))
+    return;
+
+  // Missed: build the entry holding a lock on the cache directory, so that
+  // of many runs started together one parses the image and the rest wait
+  // and map its entry.
+  int dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0)
+    flock(dir_fd, LOCK_EX);
+  if (!map_mem_cache(mms, nchannels, path, hdr))
+  {
+    uint64_t image_end = load_mem(mems, fn, line_size, nchannels, mem_base, mms[0]->get_size());
+    write_mem_cache(mms, nchannels, path, hdr, image_end);
+    // share the new entry's pages rather than keep a private copy
+    map_mem_cache(mms, nchannels, path, hdr);
+  }
+  if (dir_fd >= 0)
+    close(dir_fd);
 }
@@ -4,8 +4,53 @@
 #define MM_EMULATOR_H
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <cstdio>
 #include <cstring>
 #include <queue>
+#include <vector>
+
+// One channel's AXI ports as driven by the target...
+struct mm_port_in_t
+{
+  bool ar_valid;
+  uint64_t ar_addr;
+  uint64_t ar_id;
+  uint64_t ar_size;
+  uint64_t ar_len;
+
+  bool aw_valid;
+  uint64_t aw_addr;
+  uint64_t aw_id;
+  uint64_t aw_size;
+  uint64_t aw_len;
+
+  bool w_valid;
+  uint64_t w_strb;
+  void *w_data;
+  bool w_last;
+
+  bool r_ready;
+  bool b_ready;
+};
+
+// ...and as driven by the memory model.
+struct mm_port_out_t
+{
+  bool ar_ready;
+  bool aw_ready;
+  bool w_ready;
+
+  bool b_valid;
+  uint64_t b_resp;
+  uint64_t b_id;
+
+  bool r_valid;
+  uint64_t r_resp;
+  uint64_t r_id;
+  void *r_data;
+  bool r_last;
+};
 
 class mm_t
 {
@@ -49,13 +94,39 @@ class mm_t
     bool b_ready
   ) = 0;
 
+  // Advance the model by one cycle in which the target presents no request,
+  // provided that can't change any of the model's outputs (nothing is queued
+  // for the target), and return true; otherwise do nothing and return false.
+  // The testbench uses this to skip marshalling ports for quiescent channels.
+  virtual bool idle_tick() { return false; }
+
+  // Read beats and write acknowledgements queued for the target, for stats
+  virtual size_t rresp_depth() { return 0; }
+  virtual size_t bresp_depth() { return 0; }
+
   virtual void* get_data() { return data; }
   virtual size_t get_size() { return size; }
   virtual size_t get_word_size() { return word_size; }
   virtual size_t get_line_size() { return line_size; }
 
   void write(uint64_t addr, uint8_t *data, uint64_t strb, uint64_t size);
-  std::vector<char> read(uint64_t addr);
+  void *read(uint64_t addr);
+
+  // Replace the first len bytes of memory (a multiple of the host page size)
+  // with a private, copy-on-write mapping of fd at offset.
+  void map_image(int fd, off_t offset, size_t len);
+
+  // Return to the state just after init(), for the next of several tests
+  // run in one process: memory reads as zero again and nothing is queued or
+  // in flight.  Only the host pages the previous test touched are freed.
+  virtual void reset();
+
+  // Checkpointing.  save() writes the memory image (only its non-zero pages)
+  // and any in-flight transactions; checkpointable() is false while the
+  // model holds state that cannot be saved.
+  virtual bool checkpointable() { return true; }
+  virtual void save(FILE* f);
+  virtual void restore(FILE* f);
 
   virtual ~mm_t();
 
@@ -69,13 +140,11 @@ class mm_t
 struct mm_rresp_t
 {
   uint64_t id;
-  std::vector<char> data;
   bool last;
 
-  mm_rresp_t(uint64_t id, std::vector<char> data, bool last)
+  mm_rresp_t(uint64_t id, bool last)
   {
     this->id = id;
-    this->data = data;
     this->last = last;
   }
 
@@ -86,7 +155,40 @@ struct mm_rresp_t
   }
 };
 
-class mm_magic_t : public mm_t
+// Ring buffer of read response beats.  The beat data lives inline in one
+// flat buffer, so pushing and popping beats never allocates; the ring only
+// grows (by doubling) on the rare occasion that it fills up.
+class mm_rresp_queue_t
+{
+ public:
+  mm_rresp_queue_t() : beat_size(0), head(0), count(0) {}
+
+  void init(size_t beat_size, size_t capacity = 64);
+
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+
+  const mm_rresp_t& front() const { return beats[head]; }
+  void *front_data() { return &storage[head * beat_size]; }
+
+  void push(uint64_t id, const void *data, bool last);
+  void pop() { head = (head + 1) & (beats.size() - 1); count--; }
+  void clear() { head = 0; count = 0; }
+
+  void save(FILE* f);
+  void restore(FILE* f);
+
+ private:
+  void grow();
+
+  size_t beat_size;
+  size_t head;
+  size_t count;
+  std::vector<mm_rresp_t> beats;
+  std::vector<char> storage;
+};
+
+class mm_magic_t final : public mm_t
 {
  public:
   mm_magic_t() : store_inflight(false) {}
@@ -102,9 +204,20 @@ class mm_magic_t : public mm_t
   virtual bool r_valid() { return !rresp.empty(); }
   virtual uint64_t r_resp() { return 0; }
   virtual uint64_t r_id() { return r_valid() ? rresp.front().id: 0; }
-  virtual void *r_data() { return r_valid() ? &rresp.front().data[0] : &dummy_data[0]; }
+  virtual void *r_data() { return r_valid() ? rresp.front_data() : &dummy_data[0]; }
   virtual bool r_last() { return r_valid() ? rresp.front().last : false; }
 
+  virtual bool idle_tick()
+  {
+    if (!rresp.empty() || !bresp.empty())
+      return false;
+    cycle++;
+    return true;
+  }
+
+  virtual size_t rresp_depth() { return rresp.size(); }
+  virtual size_t bresp_depth() { return bresp.size(); }
+
   virtual void tick
   (
     bool ar_valid,
@@ -128,6 +241,10 @@ class mm_magic_t : public mm_t
     bool b_ready
   );
 
+  virtual void reset();
+  virtual void save(FILE* f);
+  virtual void restore(FILE* f);
+
  protected:
   bool store_inflight;
   uint64_t store_addr;
@@ -137,10 +254,54 @@ class mm_magic_t : public mm_t
   std::vector<char> dummy_data;
   std::queue<uint64_t> bresp;
 
-  std::queue<mm_rresp_t> rresp;
+  mm_rresp_queue_t rresp;
 
   uint64_t cycle;
 };
 
-void load_mem(void** mems, const char* fn, int line_size, int nchannels);
+// Exchange all of a channel's ports with its model in one call.  When
+// model_t is a concrete (final) model rather than mm_t, the accessors are
+// bound statically and can be inlined into the testbench's per-cycle loop.
+template <class model_t>
+inline void mm_get_ports(model_t* m, mm_port_out_t* out)
+{
+  out->ar_ready = m->ar_ready();
+  out->aw_ready = m->aw_ready();
+  out->w_ready = m->w_ready();
+
+  out->b_valid = m->b_valid();
+  out->b_resp = m->b_resp();
+  out->b_id = m->b_id();
+
+  out->r_valid = m->r_valid();
+  out->r_resp = m->r_resp();
+  out->r_id = m->r_id();
+  out->r_data = m->r_data();
+  out->r_last = m->r_last();
+}
+
+template <class model_t>
+inline void mm_tick(model_t* m, const mm_port_in_t& in)
+{
+  m->tick(
+    in.ar_valid, in.ar_addr, in.ar_id, in.ar_size, in.ar_len,
+    in.aw_valid, in.aw_addr, in.aw_id, in.aw_size, in.aw_len,
+    in.w_valid, in.w_strb, in.w_data, in.w_last,
+    in.r_ready, in.b_ready);
+}
+
+// Load an image into the per-channel buffers mems, each channel_size bytes.
+// Exits with a message if the image doesn't fit.  Returns the end of the
+// highest (interleaved, pre-split) memory offset the image wrote.
+uint64_t load_mem(void** mems, const char* fn, int line_size, int nchannels, uint64_t mem_base,
+                  size_t channel_size);
+
+// As load_mem, but images go through a cache in cache_dir of their loaded,
+// per-channel memory, which is mapped copy-on-write into memory.  Runs of
+// the same image share the entry's pages, so each one's resident memory is
+// just the pages it writes; with cache_dir on tmpfs (/dev/shm) the entry
+// is never read from disk.
+static const char* const default_mem_cache_dir = "/dev/shm";
+void load_mem_cached(mm_t** mms, const char* fn, int line_size, int nchannels,
+                     uint64_t mem_base, const char* cache_dir = default_mem_cache_dir);
 #endif
@@ -2,6 +2,7 @@
 
 #include "mm_dramsim2.h"
 #include "mm.h"
+#include "checkpoint.h"
 #include <DRAMSim.h>
 #include <iostream>
 #include <fstream>
@@ -15,22 +16,74 @@
 
 using namespace DRAMSim;
 
+void mm_req_table_t::push(const mm_req_t& req)
+{
+  if (2 * (count + 1) > slots.size())
+    grow();
+
+  size_t mask = slots.size() - 1;
+  size_t i = home(req.addr);
+  while (slots[i].used)
+    i = (i + 1) & mask;
+  slots[i].used = true;
+  slots[i].seq = seq++;
+  slots[i].req = req;
+  count++;
+}
+
+mm_req_t mm_req_table_t::pop(uint64_t addr)
+{
+  // the oldest transaction to addr is somewhere in the run of used slots
+  // that starts at addr's home slot
+  size_t mask = slots.size() - 1;
+  size_t hit = slots.size();
+  for (size_t i = home(addr); slots[i].used; i = (i + 1) & mask)
+    if (slots[i].req.addr == addr && (hit == slots.size() || slots[i].seq < slots[hit].seq))
+      hit = i;
+  assert(hit != slots.size());
+  mm_req_t req = slots[hit].req;
+
+  // close the gap by moving back any later slot that would no longer be
+  // reachable from its home slot
+  size_t i = hit;
+  for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+    size_t k = home(slots[j].req.addr);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i].used = false;
+  count--;
+  return req;
+}
+
+void mm_req_table_t::grow()
+{
+  std::vector<slot_t> old(slots.size() * 2);
+  old.swap(slots);
+  size_t mask = slots.size() - 1;
+  for (auto& s: old) {
+    if (!s.used)
+      continue;
+    size_t i = home(s.req.addr);
+    while (slots[i].used)
+      i = (i + 1) & mask;
+    slots[i] = s;
+  }
+}
+
 void mm_dramsim2_t::read_complete(unsigned id, uint64_t address, uint64_t clock_cycle)
 {
-  auto req = rreq[address].front();
+  auto req = rreq.pop(address);
   uint64_t start_addr = (address / word_size) * word_size;
-  for (int i = 0; i < req.len; i++) {
-    auto dat = read(start_addr + i * word_size);
-    rresp.push(mm_rresp_t(req.id, dat, (i == req.len - 1)));
-  }
-  rreq[address].pop();
+  for (int i = 0; i < req.len; i++)
+    rresp.push(req.id, read(start_addr + i * word_size), (i == req.len - 1));
 }
 
 void mm_dramsim2_t::write_complete(unsigned id, uint64_t address, uint64_t clock_cycle)
 {
-  auto b_id = wreq[address].front();
-  bresp.push(b_id);
-  wreq[address].pop();
+  bresp.push(wreq.pop(address).id);
 }
 
 void power_callback(double a, double b, double c, double d)
@@ -44,6 +97,7 @@ void mm_dramsim2_t::init(size_t sz, int wsz, int lsz)
   mm_t::init(sz, wsz, lsz);
 
   dummy_data.resize(word_size);
+  rresp.init(word_size);
 
   assert(size % (1024*1024) == 0);
   mem = getMemorySystemInstance("DDR3_micron_64M_8B_x4_sg15.ini", "system.ini", "dramsim2_ini", "results", size/(1024*1024));
@@ -85,28 +139,34 @@ void mm_dramsim2_t::tick(
   bool b_fire = b_valid() && b_ready;
 
   if (ar_fire) {
-    rreq[ar_addr].push(mm_req_t(ar_id, ar_len + 1, ar_addr));
+    rreq.push(mm_req_t(ar_id, ar_len + 1, ar_addr));
     mem->addTransaction(false, ar_addr);
   }
 
   if (aw_fire) {
-    store_addr = aw_addr;
-    store_id = aw_id;
-    store_count = aw_len + 1;
-    store_size = 1 << aw_size;
-    store_inflight = true;
+    store_t& s = stores[(store_head + store_count) % max_stores];
+    s.req = mm_req_t(aw_id, aw_len + 1, aw_addr);
+    s.base = aw_addr;
+    s.size = 1 << aw_size;
+    store_count++;
   }
 
   if (w_fire) {
-    write(store_addr, (uint8_t *) w_data, w_strb, store_size);
-    store_addr += store_size;
-    store_count--;
-
-    if (store_count == 0) {
-      store_inflight = false;
-      mem->addTransaction(true, store_addr);
-      wreq[store_addr].push(store_id);
+    store_t& s = stores[store_head];
+    write(s.req.addr, (uint8_t *) w_data, w_strb, s.size);
+    s.req.addr += s.size;
+
+    if (--s.req.len == 0)
       assert(w_last);
+  }
+
+  // Issue the head burst once all its data is in
+  if (store_count > 0 && stores[store_head].req.len == 0) {
+    store_t& s = stores[store_head];
+    if (mem->addTransaction(true, s.base)) {
+      wreq.push(mm_req_t(s.req.id, 0, s.base));
+      store_head = (store_head + 1) % max_stores;
+      store_count--;
     }
   }
 
@@ -116,6 +176,40 @@ void mm_dramsim2_t::tick(
   if (r_fire)
     rresp.pop();
 
-  mem->update();
+  if (!skip_idle || !rreq.empty() || !wreq.empty())
+    step();
   cycle++;
 }
+
+bool mm_dramsim2_t::checkpointable()
+{
+  return store_count == 0 && rreq.empty() && wreq.empty() &&
+    bresp.empty() && rresp.empty();
+}
+
+void mm_dramsim2_t::reset()
+{
+  while (!rreq.empty() || !wreq.empty())
+  {
+    step();
+    cycle++;
+  }
+  mm_t::reset();
+  store_head = 0;
+  store_count = 0;
+  bresp = std::queue<uint64_t>();
+  rresp.clear();
+}
+
+void mm_dramsim2_t::save(FILE* f)
+{
+  assert(checkpointable());
+  mm_t::save(f);
+  ckpt_put(f, cycle);
+}
+
+void mm_dramsim2_t::restore(FILE* f)
+{
+  mm_t::restore(f);
+  cycle = ckpt_get<uint64_t>(f);
+}
@@ -5,8 +5,8 @@
 
 #include "mm.h"
 #include <DRAMSim.h>
-#include <map>
 #include <queue>
+#include <vector>
 #include <stdint.h>
 
 struct mm_req_t {
@@ -29,25 +29,104 @@ struct mm_req_t {
   }
 };
 
-class mm_dramsim2_t : public mm_t
+// Transactions outstanding in DRAMSim2, found again by address when it
+// calls back.  An open-addressed table with linear probing, so issuing and
+// completing a transaction never allocates once the table has grown to the
+// number in flight.  Transactions to the same address complete in the order
+// they were issued.
+class mm_req_table_t
 {
  public:
-  mm_dramsim2_t() : store_inflight(false) {}
+  mm_req_table_t() : count(0), seq(0) { slots.resize(64); }
+
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+
+  void push(const mm_req_t& req);
+  mm_req_t pop(uint64_t addr);
+
+ private:
+  struct slot_t
+  {
+    bool used;
+    uint64_t seq;
+    mm_req_t req;
+    slot_t() : used(false), seq(0) {}
+  };
+
+  size_t home(uint64_t addr) const
+  {
+    return ((addr >> 6) * 0x9e3779b97f4a7c15ULL >> 32) & (slots.size() - 1);
+  }
+  void grow();
+
+  std::vector<slot_t> slots;
+  size_t count;
+  uint64_t seq;
+};
+
+class mm_dramsim2_t final : public mm_t
+{
+ public:
+  mm_dramsim2_t()
+    : store_head(0), store_count(0), dram_cycles(1), cpu_cycles(1),
+      dram_phase(0), skip_idle(false) {}
+
+  // DRAMSim2 is clocked dram_cycles times for every cpu_cycles ticks.
+  // DRAMSim2's own setCPUClockSpeed() isn't used: it takes a frequency in
+  // Hz, approximates its ratio to the device's tCK as a fraction, and keeps
+  // the phase inside DRAMSim2's clock crosser.  Counting the phase here
+  // keeps the ratio exactly the one +dramsim-clock gives.
+  //
+  // With skip_idle set, DRAMSim2 isn't clocked at all while it has no
+  // transactions outstanding, which is faster but inexact: refresh and
+  // power-down are scheduled in DRAM cycles, so skipping them moves every
+  // later refresh and changes the latency of the requests that follow.
+  // That is why it is opt-in and exact stepping is the default.
+  void set_clock_ratio(uint64_t dram, uint64_t cpu)
+  {
+    dram_cycles = dram;
+    cpu_cycles = cpu;
+  }
+  void set_skip_idle(bool skip) { skip_idle = skip; }
 
   virtual void init(size_t sz, int word_size, int line_size);
 
-  virtual bool ar_ready() { return mem->willAcceptTransaction(); }
-  virtual bool aw_ready() { return mem->willAcceptTransaction() && !store_inflight; }
-  virtual bool w_ready() { return store_inflight; }
+  // Reads give way to a write burst whose last beat is due, so the two
+  // never compete for DRAMSim2's last free slot in the same cycle.
+  virtual bool ar_ready() { return mem->willAcceptTransaction() && !store_issuing(); }
+  // AW bursts are accepted ahead of their data, up to max_stores at once.
+  // There is no WID, so W beats arrive in AW order and fill the bursts
+  // front to back; a burst's last beat waits for room in DRAMSim2, and a
+  // complete burst that DRAMSim2 turns away anyway is retried every tick.
+  virtual bool aw_ready() { return store_count < max_stores; }
+  virtual bool w_ready()
+  {
+    return store_count > 0 && stores[store_head].req.len > 0 &&
+      (stores[store_head].req.len > 1 || mem->willAcceptTransaction());
+  }
   virtual bool b_valid() { return !bresp.empty(); }
   virtual uint64_t b_resp() { return 0; }
   virtual uint64_t b_id() { return b_valid() ? bresp.front() : 0; }
   virtual bool r_valid() { return !rresp.empty(); }
   virtual uint64_t r_resp() { return 0; }
   virtual uint64_t r_id() { return r_valid() ? rresp.front().id: 0; }
-  virtual void *r_data() { return r_valid() ? &rresp.front().data[0] : &dummy_data[0]; }
+  virtual void *r_data() { return r_valid() ? rresp.front_data() : &dummy_data[0]; }
   virtual bool r_last() { return r_valid() ? rresp.front().last : false; }
 
+  virtual bool idle_tick()
+  {
+    if (store_count || !rreq.empty() || !wreq.empty() || !rresp.empty() || !bresp.empty())
+      return false;
+    if (!skip_idle)
+      step();
+    cycle++;
+    return true;
+  }
+
+  virtual size_t rresp_depth() { return rresp.size(); }
+  virtual size_t bresp_depth() { return bresp.size(); }
+
   virtual void tick
   (
     bool ar_valid,
@@ -71,22 +150,56 @@ class mm_dramsim2_t : public mm_t
     bool b_ready
   );
 
+  // DRAMSim2's internal timing state can't be saved, so checkpoints are
+  // only taken while no transactions are outstanding; a restored model
+  // starts with idle DRAM.
+  virtual bool checkpointable();
+  virtual void save(FILE* f);
+
+  // Transactions already handed to DRAMSim2 can't be withdrawn, so reset()
+  // clocks it until they have all completed and then drops the responses.
+  // The DRAMSim2 instance itself is kept.
+  virtual void reset();
+  virtual void restore(FILE* f);
 
  protected:
   DRAMSim::MultiChannelMemorySystem *mem;
   uint64_t cycle;
 
-  bool store_inflight;
-  uint64_t store_addr;
-  uint64_t store_id;
-  uint64_t store_size;
-  uint64_t store_count;
+  // AW bursts awaiting data: addr is the next beat's, len the beats left
+  struct store_t
+  {
+    mm_req_t req;
+    uint64_t base;
+    uint64_t size;
+  };
+  static const size_t max_stores = 8;
+  store_t stores[max_stores];
+  size_t store_head;
+  size_t store_count;
+
   std::vector<char> dummy_data;
   std::queue<uint64_t> bresp;
-  std::map<uint64_t, std::queue<uint64_t> > wreq;
+  mm_req_table_t wreq;
+
+  mm_req_table_t rreq;
+  mm_rresp_queue_t rresp;
+
+  uint64_t dram_cycles;
+  uint64_t cpu_cycles;
+  uint64_t dram_phase;
+  bool skip_idle;
 
-  std::map<uint64_t, std::queue<mm_req_t> > rreq;
-  std::queue<mm_rresp_t> rresp;
+  // The head burst has at most its last beat to come, or is complete and
+  // waiting to be issued
+  bool store_issuing() { return store_count > 0 && stores[store_head].req.len <= 1; }
+
+  // Advance DRAMSim2 by one CPU cycle
+  void step()
+  {
+    for (dram_phase += dram_cycles; dram_phase >= cpu_cycles; dram_phase -= cpu_cycles)
+      mem->update();
+  }
 
   void read_complete(unsigned id, uint64_t address, uint64_t clock_cycle);
   void write_complete(unsigned id, uint64_t address, uint64_t clock_cycle);
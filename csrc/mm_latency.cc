@@ -0,0 +1,206 @@
+// See LICENSE for license details.
+
+#include "mm_latency.h"
+#include "checkpoint.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Completions are filed under due % wheel_size; an event further out than
+// that simply stays in its bucket until the wheel comes round to it again.
+static const size_t wheel_size = 1024;
+
+bool mm_latency_params_t::parse(const char* spec)
+{
+  while (*spec)
+  {
+    const char* eq = strchr(spec, '=');
+    if (!eq)
+      return false;
+    std::string key(spec, eq - spec);
+    char* end;
+    double val = strtod(eq + 1, &end);
+    if (end == eq + 1 || (*end && *end != ',') || val < 0)
+      return false;
+
+    if (key == "read")
+      read_latency = val;
+    else if (key == "write")
+      write_latency = val;
+    else if (key == "banks")
+      banks = val;
+    else if (key == "busy")
+      bank_busy = val;
+    else if (key == "bw")
+      bytes_per_cycle = val;
+    else if (key == "outstanding")
+      max_outstanding = val;
+    else
+      return false;
+
+    spec = *end ? end + 1 : end;
+  }
+  return max_outstanding > 0;
+}
+
+void mm_latency_t::init(size_t sz, int wsz, int lsz)
+{
+  mm_t::init(sz, wsz, lsz);
+  dummy_data.resize(word_size);
+  rresp.init(word_size);
+  wheel.resize(wheel_size);
+  bank_free.assign(std::max<uint64_t>(params.banks, 1), 0);
+  bus_free = 0;
+}
+
+// Returns the cycle at which a request for beats words at addr, accepted
+// this cycle, completes, and reserves its bank and bus time.
+uint64_t mm_latency_t::schedule(uint64_t addr, uint64_t beats, uint64_t latency)
+{
+  uint64_t start = cycle;
+  if (params.banks)
+  {
+    uint64_t& bank = bank_free[(addr / line_size) % params.banks];
+    start = std::max(start, bank);
+    bank = start + params.bank_busy;
+  }
+
+  uint64_t due = start + latency;
+  if (params.bytes_per_cycle > 0)
+  {
+    bus_free = std::max(bus_free, double(due)) + beats * word_size / params.bytes_per_cycle;
+    due = ceil(bus_free);
+  }
+  return std::max(due, cycle + 1);
+}
+
+void mm_latency_t::tick(
+  bool ar_valid,
+  uint64_t ar_addr,
+  uint64_t ar_id,
+  uint64_t ar_size,
+  uint64_t ar_len,
+
+  bool aw_valid,
+  uint64_t aw_addr,
+  uint64_t aw_id,
+  uint64_t aw_size,
+  uint64_t aw_len,
+
+  bool w_valid,
+  uint64_t w_strb,
+  void *w_data,
+  bool w_last,
+
+  bool r_ready,
+  bool b_ready)
+{
+  bool ar_fire = ar_valid && ar_ready();
+  bool aw_fire = aw_valid && aw_ready();
+  bool w_fire = w_valid && w_ready();
+  bool r_fire = r_valid() && r_ready;
+  bool b_fire = b_valid() && b_ready;
+
+  if (ar_fire) {
+    event_t e = { schedule(ar_addr, ar_len + 1, params.read_latency), ar_id, ar_addr, ar_len + 1, false };
+    wheel[e.due % wheel_size].push_back(e);
+    pending++;
+    outstanding++;
+  }
+
+  if (aw_fire) {
+    store_addr = store_base = aw_addr;
+    store_id = aw_id;
+    store_count = store_beats = aw_len + 1;
+    store_size = 1 << aw_size;
+    store_inflight = true;
+    outstanding++;
+  }
+
+  if (w_fire) {
+    write(store_addr, (uint8_t *) w_data, w_strb, store_size);
+    store_addr += store_size;
+    store_count--;
+
+    if (store_count == 0) {
+      store_inflight = false;
+      event_t e = { schedule(store_base, store_beats, params.write_latency), store_id, store_base, store_beats, true };
+      wheel[e.due % wheel_size].push_back(e);
+      pending++;
+      assert(w_last);
+    }
+  }
+
+  if (b_fire) {
+    bresp.pop();
+    outstanding--;
+  }
+
+  if (r_fire) {
+    if (rresp.front().last)
+      outstanding--;
+    rresp.pop();
+  }
+
+  cycle++;
+
+  if (pending == 0)
+    return;
+  std::vector<event_t>& bucket = wheel[cycle % wheel_size];
+  size_t kept = 0;
+  for (size_t i = 0; i < bucket.size(); i++) {
+    const event_t& e = bucket[i];
+    if (e.due != cycle) {
+      bucket[kept++] = e;
+      continue;
+    }
+    if (e.write) {
+      bresp.push(e.id);
+    } else {
+      uint64_t start_addr = (e.addr / word_size) * word_size;
+      for (uint64_t j = 0; j < e.len; j++)
+        rresp.push(e.id, read(start_addr + j * word_size), j == e.len - 1);
+    }
+    pending--;
+  }
+  bucket.resize(kept);
+}
+
+bool mm_latency_t::checkpointable()
+{
+  return outstanding == 0;
+}
+
+// Requests still on the wheel are dropped; the wheel keeps its place in
+// time, with banks and the bus idle from now on.
+void mm_latency_t::reset()
+{
+  mm_t::reset();
+  store_inflight = false;
+  bresp = std::queue<uint64_t>();
+  rresp.clear();
+  for (auto& bucket: wheel)
+    bucket.clear();
+  outstanding = 0;
+  pending = 0;
+  std::fill(bank_free.begin(), bank_free.end(), cycle);
+  bus_free = cycle;
+}
+
+void mm_latency_t::save(FILE* f)
+{
+  assert(checkpointable());
+  mm_t::save(f);
+  ckpt_put(f, cycle);
+}
+
+void mm_latency_t::restore(FILE* f)
+{
+  mm_t::restore(f);
+  cycle = ckpt_get<uint64_t>(f);
+  std::fill(bank_free.begin(), bank_free.end(), cycle);
+  bus_free = cycle;
+}
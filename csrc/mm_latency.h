@@ -0,0 +1,139 @@
+// See LICENSE for license details.
+
+#ifndef _MM_EMULATOR_LATENCY_H
+#define _MM_EMULATOR_LATENCY_H
+
+#include "mm.h"
+#include <queue>
+#include <vector>
+#include <stdint.h>
+
+// Timing parameters of mm_latency_t, all in target cycles.  A request
+// waits for its bank, then for the fixed latency, then for its data to
+// cross a bus that moves bytes_per_cycle (0 means no limit).
+struct mm_latency_params_t
+{
+  uint64_t read_latency;
+  uint64_t write_latency;
+  uint64_t banks;
+  uint64_t bank_busy;
+  double bytes_per_cycle;
+  uint64_t max_outstanding;
+
+  mm_latency_params_t()
+  {
+    this->read_latency = 40;
+    this->write_latency = 20;
+    this->banks = 8;
+    this->bank_busy = 4;
+    this->bytes_per_cycle = 0;
+    this->max_outstanding = 16;
+  }
+
+  // Override the defaults from "read=<n>,write=<n>,banks=<n>,busy=<n>,
+  // bw=<bytes per cycle>,outstanding=<n>", any subset in any order.
+  // Returns false if spec is malformed.
+  bool parse(const char* spec);
+};
+
+// A memory with fixed or banked latency, a bandwidth cap and a bound on
+// outstanding requests: realistic timing at close to mm_magic_t speed.
+// Completions are kept on a timing wheel, so a tick only looks at the
+// requests that finish in that cycle.
+class mm_latency_t final : public mm_t
+{
+ public:
+  mm_latency_t(const mm_latency_params_t& p = mm_latency_params_t())
+    : params(p), store_inflight(false), outstanding(0), pending(0), cycle(0) {}
+
+  virtual void init(size_t sz, int word_size, int line_size);
+
+  virtual bool ar_ready() { return outstanding < params.max_outstanding; }
+  virtual bool aw_ready() { return !store_inflight && outstanding < params.max_outstanding; }
+  virtual bool w_ready() { return store_inflight; }
+  virtual bool b_valid() { return !bresp.empty(); }
+  virtual uint64_t b_resp() { return 0; }
+  virtual uint64_t b_id() { return b_valid() ? bresp.front() : 0; }
+  virtual bool r_valid() { return !rresp.empty(); }
+  virtual uint64_t r_resp() { return 0; }
+  virtual uint64_t r_id() { return r_valid() ? rresp.front().id: 0; }
+  virtual void *r_data() { return r_valid() ? rresp.front_data() : &dummy_data[0]; }
+  virtual bool r_last() { return r_valid() ? rresp.front().last : false; }
+
+  virtual bool idle_tick()
+  {
+    if (pending || !rresp.empty() || !bresp.empty())
+      return false;
+    cycle++;
+    return true;
+  }
+
+  virtual size_t rresp_depth() { return rresp.size(); }
+  virtual size_t bresp_depth() { return bresp.size(); }
+
+  virtual void tick
+  (
+    bool ar_valid,
+    uint64_t ar_addr,
+    uint64_t ar_id,
+    uint64_t ar_size,
+    uint64_t ar_len,
+
+    bool aw_valid,
+    uint64_t aw_addr,
+    uint64_t aw_id,
+    uint64_t aw_size,
+    uint64_t aw_len,
+
+    bool w_valid,
+    uint64_t w_strb,
+    void *w_data,
+    bool w_last,
+
+    bool r_ready,
+    bool b_ready
+  );
+
+  // Banks and the bus are idle after a restore, and checkpoints are only
+  // taken with no requests outstanding, as for mm_dramsim2_t.
+  virtual bool checkpointable();
+  virtual void reset();
+  virtual void save(FILE* f);
+  virtual void restore(FILE* f);
+
+ private:
+  struct event_t
+  {
+    uint64_t due;
+    uint64_t id;
+    uint64_t addr;
+    uint64_t len;
+    bool write;
+  };
+
+  uint64_t schedule(uint64_t addr, uint64_t beats, uint64_t latency);
+
+  mm_latency_params_t params;
+
+  bool store_inflight;
+  uint64_t store_addr;
+  uint64_t store_base;
+  uint64_t store_id;
+  uint64_t store_size;
+  uint64_t store_count;
+  uint64_t store_beats;
+  std::vector<char> dummy_data;
+  std::queue<uint64_t> bresp;
+  mm_rresp_queue_t rresp;
+
+  // Requests accepted but not yet fully answered, and those on the wheel
+  uint64_t outstanding;
+  size_t pending;
+  std::vector<std::vector<event_t> > wheel;
+  std::vector<uint64_t> bank_free;
+  double bus_free;
+
+  uint64_t cycle;
+};
+
+#endif
@@ -0,0 +1,235 @@
+// See LICENSE for license details.
+
+// mm_replay - drives a memory model from an AXI trace recorded by the
+// emulator (+axi-trace=<file>), without the RTL.  Each channel's AR, AW
+// and W handshakes are presented to the model in their recorded order, no
+// earlier than their recorded cycle (or as soon as the model will take
+// them, with -a), R and B are always ready, and the model's traffic
+// counters are reported once every response has come back.  Memory starts
+// out zeroed, so read data won't match the recorded run, but timing only
+// depends on addresses.
+//
+// USAGE: mm_replay [-m magic|dramsim|latency[:<params>]] [-a] [-j <stats.json>] <trace>
+
+#include "axi_trace.h"
+#include "mm.h"
+#include "mm_dramsim2.h"
+#include "mm_latency.h"
+#include "mm_stats.h"
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+struct replay_channel_t
+{
+  mm_t* mm;
+  std::deque<axi_trace_event_t> ar, aw, w;
+  uint64_t outstanding;  // bursts accepted but not yet answered
+};
+
+static void usage()
+{
+  fprintf(stderr, "usage: mm_replay [-m magic|dramsim|latency[:<params>]] [-a] "
+          "[-j <stats.json>] <trace>\n");
+  exit(-1);
+}
+
+static double wall()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+  const char* model = "magic";
+  const char* stats_json = NULL;
+  bool asap = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:aj:")) != -1)
+  {
+    if (opt == 'm')
+      model = optarg;
+    else if (opt == 'a')
+      asap = true;
+    else if (opt == 'j')
+      stats_json = optarg;
+    else
+      usage();
+  }
+  if (optind != argc - 1)
+    usage();
+
+  axi_trace_reader_t trace(argv[optind]);
+  const axi_trace_header_t& hdr = trace.header();
+
+  std::vector<replay_channel_t> channels(hdr.nchannels);
+  std::vector<mm_stats_t> stats(hdr.nchannels, mm_stats_t(hdr.word_size));
+  for (auto& ch: channels)
+  {
+    if (strcmp(model, "magic") == 0)
+      ch.mm = new mm_magic_t;
+    else if (strcmp(model, "dramsim") == 0)
+      ch.mm = new mm_dramsim2_t;
+    else if (strncmp(model, "latency", 7) == 0)
+    {
+      mm_latency_params_t params;
+      if (model[7] && (model[7] != ':' || !params.parse(model + 8)))
+      {
+        fprintf(stderr, "bad latency model parameters %s\n", model);
+        exit(-1);
+      }
+      ch.mm = new mm_latency_t(params);
+    }
+    else
+      usage();
+    ch.mm->init(hdr.mem_size, hdr.word_size, hdr.line_size);
+    ch.outstanding = 0;
+  }
+
+  // The trace is pulled into per-channel queues a bounded distance ahead
+  const size_t max_queued = 4096;
+  size_t queued = 0;
+  bool trace_done = false;
+  uint64_t recorded_cycles = 0;
+  auto refill = [&]() {
+    axi_trace_event_t e;
+    while (queued < max_queued && !trace_done)
+    {
+      if (!trace.next(&e))
+      {
+        trace_done = true;
+        break;
+      }
+      recorded_cycles = e.cycle + 1;
+      if (e.channel >= int(channels.size()))
+      {
+        fprintf(stderr, "%s: record for channel %d of %d\n", argv[optind], e.channel, hdr.nchannels);
+        exit(-1);
+      }
+      replay_channel_t& ch = channels[e.channel];
+      if (e.kind == AXI_AR)
+        ch.ar.push_back(e);
+      else if (e.kind == AXI_AW)
+        ch.aw.push_back(e);
+      else if (e.kind == AXI_W)
+        ch.w.push_back(e);
+      else
+        continue;
+      queued++;
+    }
+  };
+
+  double start = wall();
+  uint64_t cycle = 0;
+  for (bool busy = true; busy; cycle++)
+  {
+    refill();
+    busy = !trace_done || queued;
+
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+      replay_channel_t& ch = channels[i];
+      auto due = [&](const std::deque<axi_trace_event_t>& q) {
+        return !q.empty() && (asap || q.front().cycle <= cycle);
+      };
+
+      mm_port_in_t in;
+      memset(&in, 0, sizeof(in));
+      in.ar_valid = due(ch.ar);
+      in.aw_valid = due(ch.aw);
+      in.w_valid = due(ch.w);
+      in.r_ready = true;
+      in.b_ready = true;
+      busy |= ch.outstanding != 0;
+
+      if (!in.ar_valid && !in.aw_valid && !in.w_valid && ch.mm->idle_tick())
+      {
+        stats[i].idle();
+        continue;
+      }
+
+      if (in.ar_valid)
+      {
+        const axi_trace_event_t& e = ch.ar.front();
+        in.ar_addr = e.addr;
+        in.ar_id = e.id;
+        in.ar_size = e.size;
+        in.ar_len = e.len;
+      }
+      if (in.aw_valid)
+      {
+        const axi_trace_event_t& e = ch.aw.front();
+        in.aw_addr = e.addr;
+        in.aw_id = e.id;
+        in.aw_size = e.size;
+        in.aw_len = e.len;
+      }
+      if (in.w_valid)
+      {
+        const axi_trace_event_t& e = ch.w.front();
+        in.w_strb = e.strb;
+        in.w_data = (void*)e.data;
+        in.w_last = e.last;
+      }
+
+      mm_port_out_t out;
+      mm_get_ports(ch.mm, &out);
+      stats[i].tick(cycle, in, out, ch.mm->rresp_depth(), ch.mm->bresp_depth());
+      mm_tick(ch.mm, in);
+
+      if (in.ar_valid && out.ar_ready)
+      {
+        ch.ar.pop_front();
+        ch.outstanding++;
+        queued--;
+      }
+      if (in.aw_valid && out.aw_ready)
+      {
+        ch.aw.pop_front();
+        ch.outstanding++;
+        queued--;
+      }
+      if (in.w_valid && out.w_ready)
+      {
+        ch.w.pop_front();
+        queued--;
+      }
+      if ((out.r_valid && out.r_last) || out.b_valid)
+        ch.outstanding -= (out.r_valid && out.r_last) + out.b_valid;
+    }
+  }
+  double secs = wall() - start;
+
+  fprintf(stderr, "replay: %ld cycles (%ld as recorded) in %.3f s, %.0f cycles/s\n",
+          cycle, recorded_cycles, secs, secs > 0 ? cycle / secs : 0.0);
+  for (size_t i = 0; i < channels.size(); i++)
+    stats[i].report(stderr, i);
+
+  if (stats_json)
+  {
+    FILE* f = fopen(stats_json, "w");
+    if (!f)
+    {
+      fprintf(stderr, "Couldn't open %s\n", stats_json);
+      exit(-1);
+    }
+    fprintf(f, "{\"cycles\": %ld, \"recorded_cycles\": %ld, \"channels\": [", cycle, recorded_cycles);
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+      fprintf(f, i ? ",\n  " : "\n  ");
+      stats[i].json(f);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+  }
+
+  for (auto& ch: channels)
+    delete ch.mm;
+  return 0;
+}
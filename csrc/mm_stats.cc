@@ -0,0 +1,173 @@
+// See LICENSE for license details.
+
+#include "mm_stats.h"
+#include <algorithm>
+
+mm_stats_t::mm_stats_t(size_t word_size)
+  : idle_cycles(0), busy_cycles(0),
+    read_bursts(0), write_bursts(0), read_beats(0), write_beats(0),
+    read_bytes(0), write_bytes(0), write_acks(0), reads_done(0),
+    reads_dropped(0), writes_dropped(0),
+    ar_stalls(0), aw_stalls(0), w_stalls(0), r_stalls(0), b_stalls(0),
+    read_latency_sum(0), write_latency_sum(0), word_size(word_size)
+{
+  std::fill(rresp_depth, rresp_depth + nbuckets, 0);
+  std::fill(bresp_depth, bresp_depth + nbuckets, 0);
+  std::fill(read_latency, read_latency + nbuckets, 0);
+  std::fill(write_latency, write_latency + nbuckets, 0);
+}
+
+void mm_stats_t::tick(uint64_t cycle, const mm_port_in_t& in, const mm_port_out_t& out,
+                      size_t rdepth, size_t bdepth)
+{
+  busy_cycles++;
+  rresp_depth[bucket(rdepth)]++;
+  bresp_depth[bucket(bdepth)]++;
+
+  if (in.ar_valid)
+  {
+    if (out.ar_ready)
+    {
+      read_bursts++;
+      if (in.ar_id >= read_start.size())
+        read_start.resize(in.ar_id + 1);
+      read_start[in.ar_id].push(cycle);
+    }
+    else
+      ar_stalls++;
+  }
+
+  if (in.aw_valid)
+  {
+    if (out.aw_ready)
+    {
+      write_bursts++;
+      if (in.aw_id >= write_start.size())
+        write_start.resize(in.aw_id + 1);
+      write_start[in.aw_id].push(cycle);
+    }
+    else
+      aw_stalls++;
+  }
+
+  if (in.w_valid)
+  {
+    if (out.w_ready)
+    {
+      write_beats++;
+      write_bytes += __builtin_popcountll(in.w_strb);
+    }
+    else
+      w_stalls++;
+  }
+
+  if (out.r_valid)
+  {
+    if (in.r_ready)
+    {
+      read_beats++;
+      read_bytes += word_size;
+      if (out.r_last && out.r_id < read_start.size() && !read_start[out.r_id].empty())
+      {
+        uint64_t latency = cycle - read_start[out.r_id].front();
+        reads_done++;
+        read_latency[bucket(latency)]++;
+        read_latency_sum += latency;
+        read_start[out.r_id].pop();
+      }
+    }
+    else
+      r_stalls++;
+  }
+
+  if (out.b_valid)
+  {
+    if (in.b_ready)
+    {
+      write_acks++;
+      if (out.b_id < write_start.size() && !write_start[out.b_id].empty())
+      {
+        uint64_t latency = cycle - write_start[out.b_id].front();
+        write_latency[bucket(latency)]++;
+        write_latency_sum += latency;
+        write_start[out.b_id].pop();
+      }
+    }
+    else
+      b_stalls++;
+  }
+}
+
+void mm_stats_t::drop_outstanding()
+{
+  for (size_t i = 0; i < read_start.size(); i++)
+  {
+    reads_dropped += read_start[i].size();
+    read_start[i] = std::queue<uint64_t>();
+  }
+  for (size_t i = 0; i < write_start.size(); i++)
+  {
+    writes_dropped += write_start[i].size();
+    write_start[i] = std::queue<uint64_t>();
+  }
+}
+
+static void report_histogram(FILE* f, const char* name, const uint64_t* h, int n)
+{
+  fprintf(f, "  %-16s", name);
+  for (int i = 0; i < n; i++)
+    if (h[i])
+      fprintf(f, " %s%llu:%llu", i ? "<" : "", i ? 1ULL << i : 0ULL, (unsigned long long)h[i]);
+  fprintf(f, "\n");
+}
+
+void mm_stats_t::report(FILE* f, int channel)
+{
+  uint64_t cycles = busy_cycles + idle_cycles;
+  fprintf(f, "mm channel %d: %ld cycles (%ld idle)\n", channel, cycles, idle_cycles);
+  fprintf(f, "  reads:  %ld bursts, %ld beats, %ld bytes; mean latency %.1f cycles\n",
+          read_bursts, read_beats, read_bytes,
+          reads_done ? double(read_latency_sum) / reads_done : 0.0);
+  fprintf(f, "  writes: %ld bursts, %ld beats, %ld bytes; mean latency %.1f cycles\n",
+          write_bursts, write_beats, write_bytes,
+          write_acks ? double(write_latency_sum) / write_acks : 0.0);
+  fprintf(f, "  stalls: ar %ld, aw %ld, w %ld (memory not ready); r %ld, b %ld (target not ready)\n",
+          ar_stalls, aw_stalls, w_stalls, r_stalls, b_stalls);
+
+  // idle cycles have empty queues
+  uint64_t rdepth[nbuckets], bdepth[nbuckets];
+  std::copy(rresp_depth, rresp_depth + nbuckets, rdepth);
+  std::copy(bresp_depth, bresp_depth + nbuckets, bdepth);
+  rdepth[0] += idle_cycles;
+  bdepth[0] += idle_cycles;
+  report_histogram(f, "read latency", read_latency, nbuckets);
+  report_histogram(f, "write latency", write_latency, nbuckets);
+  report_histogram(f, "rresp depth", rdepth, nbuckets);
+  report_histogram(f, "bresp depth", bdepth, nbuckets);
+}
+
+static void json_histogram(FILE* f, const char* name, const uint64_t* h, int n, uint64_t extra0)
+{
+  fprintf(f, ", \"%s\": [", name);
+  for (int i = 0; i < n; i++)
+    fprintf(f, "%s%llu", i ? ", " : "", (unsigned long long)(h[i] + (i ? 0 : extra0)));
+  fprintf(f, "]");
+}
+
+void mm_stats_t::json(FILE* f)
+{
+  fprintf(f, "{\"cycles\": %ld, \"idle_cycles\": %ld", busy_cycles + idle_cycles, idle_cycles);
+  fprintf(f, ", \"read_bursts\": %ld, \"read_beats\": %ld, \"read_bytes\": %ld",
+          read_bursts, read_beats, read_bytes);
+  fprintf(f, ", \"write_bursts\": %ld, \"write_beats\": %ld, \"write_bytes\": %ld",
+          write_bursts, write_beats, write_bytes);
+  fprintf(f, ", \"read_latency_sum\": %ld, \"reads_done\": %ld", read_latency_sum, reads_done);
+  fprintf(f, ", \"write_latency_sum\": %ld, \"write_acks\": %ld", write_latency_sum, write_acks);
+  fprintf(f, ", \"ar_stalls\": %ld, \"aw_stalls\": %ld, \"w_stalls\": %ld", ar_stalls, aw_stalls, w_stalls);
+  fprintf(f, ", \"r_stalls\": %ld, \"b_stalls\": %ld", r_stalls, b_stalls);
+  json_histogram(f, "read_latency", read_latency, nbuckets, 0);
+  json_histogram(f, "write_latency", write_latency, nbuckets, 0);
+  json_histogram(f, "rresp_depth", rresp_depth, nbuckets, idle_cycles);
+  json_histogram(f, "bresp_depth", bresp_depth, nbuckets, idle_cycles);
+  fprintf(f, "}");
+}
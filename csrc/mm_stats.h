@@ -0,0 +1,75 @@
+// See LICENSE for license details.
+
+#ifndef _MM_STATS_H
+#define _MM_STATS_H
+
+#include "mm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+// Traffic counters for one memory channel, kept by the testbench from the
+// AXI handshakes it sees (so they work with any mm_t).  tick() is called for
+// every cycle in which the channel was ticked, with the ports as they were
+// during that cycle, and idle() for cycles skipped as quiet.  Distributions
+// are kept as log2 histograms: bucket 0 counts zeros, bucket k counts values
+// in [2^(k-1), 2^k).
+class mm_stats_t
+{
+ public:
+  static const int nbuckets = 24;
+
+  mm_stats_t(size_t word_size);
+
+  void tick(uint64_t cycle, const mm_port_in_t& in, const mm_port_out_t& out,
+            size_t rresp_depth, size_t bresp_depth);
+  void idle() { idle_cycles++; }
+
+  // Forget bursts still in flight when the memory model is reset under
+  // them; their responses will never arrive
+  void drop_outstanding();
+  uint64_t outstanding() const
+  {
+    return (read_bursts - reads_done - reads_dropped) + (write_bursts - write_acks - writes_dropped);
+  }
+
+  void report(FILE* f, int channel);
+  void json(FILE* f);
+
+  uint64_t idle_cycles;
+  uint64_t busy_cycles;
+
+  uint64_t read_bursts;               // AR handshakes
+  uint64_t write_bursts;              // AW handshakes
+  uint64_t read_beats;
+  uint64_t write_beats;
+  uint64_t read_bytes;
+  uint64_t write_bytes;               // strobed bytes
+  uint64_t write_acks;                // B handshakes
+  uint64_t reads_done;                // last R beats
+  uint64_t reads_dropped;             // by drop_outstanding()
+  uint64_t writes_dropped;
+
+  // cycles a valid was held off by a deasserted ready
+  uint64_t ar_stalls, aw_stalls, w_stalls;   // by the memory
+  uint64_t r_stalls, b_stalls;               // by the target
+
+  uint64_t rresp_depth[nbuckets];     // queued read beats, per cycle
+  uint64_t bresp_depth[nbuckets];     // queued write acks, per cycle
+  uint64_t read_latency[nbuckets];    // AR to last R beat, in cycles
+  uint64_t write_latency[nbuckets];   // AW to B
+  uint64_t read_latency_sum;
+  uint64_t write_latency_sum;
+
+ private:
+  static int bucket(uint64_t x) { return x ? std::min(64 - __builtin_clzll(x), nbuckets - 1) : 0; }
+
+  // accept cycles of outstanding bursts, per AXI id; responses to one id
+  // return in order
+  std::vector<std::queue<uint64_t> > read_start, write_start;
+  size_t word_size;
+};
+
+#endif
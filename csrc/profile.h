@@ -0,0 +1,115 @@
+// See LICENSE for license details.
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Breaks the emulator's host time down by phase of the main loop.  Every
+// interval-th cycle is timed with the cycle counter, phase by phase, and the
+// totals are scaled up by the interval, so unsampled cycles cost only a
+// branch per phase.  Startup time runs from construction to loop_start().
+class profile_t
+{
+ public:
+  enum phase_t
+  {
+    MARSHAL,      // memory ports into the model
+    CLOCK_LO,
+    MM_TICK,      // memory models, including port reads
+    HTIF,
+    PRINT,        // +verbose, VCD and the other trace consumers
+    CLOCK_HI,
+    OTHER,
+    NPHASES
+  };
+
+  profile_t(uint64_t interval)
+    : interval(interval), sampling(false), last(0)
+  {
+    for (int i = 0; i < NPHASES; i++)
+      ticks[i] = 0;
+    start_tsc = now();
+    start_wall = create_wall = wall();
+  }
+
+  void loop_start()
+  {
+    start_tsc = now();
+    start_wall = wall();
+  }
+
+  void cycle(uint64_t n)
+  {
+    if (sampling)
+      phase(OTHER);
+    sampling = n % interval == 0;
+    if (sampling)
+      last = now();
+  }
+
+  void phase(phase_t p)
+  {
+    if (sampling)
+    {
+      uint64_t t = now();
+      ticks[p] += t - last;
+      last = t;
+    }
+  }
+
+  void report(FILE* f, uint64_t cycles)
+  {
+    static const char* names[NPHASES] = {
+      "marshal", "clock_lo", "mm_tick", "htif", "print", "clock_hi", "other"
+    };
+    double secs = wall() - start_wall;
+    double ticks_per_sec = secs > 0 ? (now() - start_tsc) / secs : 1;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(f, "profile: %ld cycles in %.3f s, %.0f cycles/s, sampled every %ld cycles\n",
+            cycles, secs, secs > 0 ? cycles / secs : 0.0, interval);
+    fprintf(f, "profile: startup %.3f s\n", start_wall - create_wall);
+    fprintf(f, "profile: peak_rss %ld KiB\n", ru.ru_maxrss);
+    for (int i = 0; i < NPHASES; i++)
+    {
+      double t = ticks[i] * interval / ticks_per_sec;
+      fprintf(f, "profile: %-8s %10.3f s %5.1f%%\n", names[i], t, secs > 0 ? 100 * t / secs : 0.0);
+    }
+  }
+
+ private:
+  static uint64_t now()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+  }
+
+  static double wall()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  uint64_t interval;
+  bool sampling;
+  uint64_t last;
+  uint64_t ticks[NPHASES];
+  uint64_t start_tsc;
+  double start_wall;
+  double create_wall;
+};
+
+#endif
@@ -0,0 +1,54 @@
+// See LICENSE for license details.
+
+#include "sampler.h"
+#include <time.h>
+
+sampler_t::sampler_t(FILE* f, uint64_t interval, int nchannels, uint64_t start_cycle)
+  : f(f), interval(interval), next(start_cycle + interval), last_cycle(start_cycle),
+    last_htif_requests(0), last_htif_mem_requests(0),
+    last_read_bytes(nchannels), last_write_bytes(nchannels)
+{
+  start_wall = last_wall = wall();
+  fprintf(f, "cycle,wall_s,cycles_per_s,htif_requests,htif_mem_requests");
+  for (int i = 0; i < nchannels; i++)
+    fprintf(f, ",ch%d_read_bytes,ch%d_write_bytes,ch%d_outstanding", i, i, i);
+  fprintf(f, "\n");
+}
+
+sampler_t::~sampler_t()
+{
+  fclose(f);
+}
+
+double sampler_t::wall()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void sampler_t::sample(uint64_t cycle, const mm_stats_t* stats,
+                       uint64_t htif_requests, uint64_t htif_mem_requests)
+{
+  double now = wall();
+  double secs = now - last_wall;
+  fprintf(f, "%ld,%.6f,%.0f,%ld,%ld", cycle, now - start_wall,
+          secs > 0 ? (cycle - last_cycle) / secs : 0.0,
+          htif_requests - last_htif_requests, htif_mem_requests - last_htif_mem_requests);
+
+  for (size_t i = 0; i < last_read_bytes.size(); i++)
+  {
+    const mm_stats_t& s = stats[i];
+    fprintf(f, ",%ld,%ld,%ld", s.read_bytes - last_read_bytes[i], s.write_bytes - last_write_bytes[i],
+            s.outstanding());
+    last_read_bytes[i] = s.read_bytes;
+    last_write_bytes[i] = s.write_bytes;
+  }
+  fprintf(f, "\n");
+
+  last_cycle = cycle;
+  last_wall = now;
+  last_htif_requests = htif_requests;
+  last_htif_mem_requests = htif_mem_requests;
+  next = cycle + interval;
+}
@@ -0,0 +1,54 @@
+// See LICENSE for license details.
+
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include "mm_stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Writes a CSV time series of emulator progress, one row every interval
+// target cycles: host wall time, simulation speed over the interval, HTIF
+// requests, and for each memory channel the bytes read and written during
+// the interval and the bursts outstanding at its end.  The counters come
+// from mm_stats_t, so the clock is only read when a row is due.
+class sampler_t
+{
+ public:
+  // Takes ownership of f and closes it when destroyed.  The first row is
+  // due interval cycles after start_cycle.
+  sampler_t(FILE* f, uint64_t interval, int nchannels, uint64_t start_cycle);
+  ~sampler_t();
+
+  bool due(uint64_t cycle) { return cycle >= next; }
+
+  void sample(uint64_t cycle, const mm_stats_t* stats,
+              uint64_t htif_requests, uint64_t htif_mem_requests);
+
+  // Write a last row for any cycles since the previous one
+  void finish(uint64_t cycle, const mm_stats_t* stats,
+              uint64_t htif_requests, uint64_t htif_mem_requests)
+  {
+    if (cycle != last_cycle)
+      sample(cycle, stats, htif_requests, htif_mem_requests);
+  }
+
+ private:
+  static double wall();
+
+  FILE* f;
+  uint64_t interval;
+  uint64_t next;
+  double start_wall;
+
+  // Totals as of the previous row
+  uint64_t last_cycle;
+  double last_wall;
+  uint64_t last_htif_requests;
+  uint64_t last_htif_mem_requests;
+  std::vector<uint64_t> last_read_bytes;
+  std::vector<uint64_t> last_write_bytes;
+};
+
+#endif
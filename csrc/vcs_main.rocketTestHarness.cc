@@ -3,6 +3,7 @@
 #include "htif_emulator.h"
 #include "mm.h"
 #include "mm_dramsim2.h"
+#include "mm_latency.h"
 #include <DirectC.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,8 @@ static unsigned htif_bytes = HTIF_WIDTH / 8;
 static mm_t* mm[N_MEM_CHANNELS];
 static const char* loadmem;
 static bool dramsim = false;
+static bool latency = false;
+static mm_latency_params_t latency_params;
 static int memory_channel_mux_select = 0;
 
 void htif_fini(vc_handle failure)
@@ -32,8 +35,18 @@ int main(int argc, char** argv)
 {
   for (int i = 1; i < argc; i++)
   {
-    if (!strcmp(argv[i], "+dramsim"))
+    if (!strcmp(argv[i], "+dramsim") || !strcmp(argv[i], "+memmodel=dramsim"))
       dramsim = true;
+    else if (!strncmp(argv[i], "+memmodel=latency", 17))
+    {
+      latency = true;
+      if (argv[i][17] && (argv[i][17] != ':' || !latency_params.parse(argv[i]+18)))
+      {
+        fprintf(stderr, "bad %s: expected +memmodel=latency[:read=<n>,write=<n>,"
+                "banks=<n>,busy=<n>,bw=<bytes/cycle>,outstanding=<n>]\n", argv[i]);
+        exit(-1);
+      }
+    }
     else if (!strncmp(argv[i], "+loadmem=", 9))
       loadmem = argv[i]+9;
     else if (!strncmp(argv[i], "+memory_channel_mux_select=", 27))
@@ -43,7 +56,12 @@ int main(int argc, char** argv)
   htif = new htif_emulator_t(std::vector<std::string>(argv + 1, argv + argc));
 
   for (int i=0; i<N_MEM_CHANNELS; i++) {
-    mm[i] = dramsim ? (mm_t*)(new mm_dramsim2_t) : (mm_t*)(new mm_magic_t);
+    if (dramsim)
+      mm[i] = new mm_dramsim2_t;
+    else if (latency)
+      mm[i] = new mm_latency_t(latency_params);
+    else
+      mm[i] = new mm_magic_t;
     mm[i]->init(MEM_SIZE / N_MEM_CHANNELS, MEM_DATA_BITS / 8, CACHE_BLOCK_BYTES);
   }
 
@@ -51,13 +69,49 @@ int main(int argc, char** argv)
     void *mems[N_MEM_CHANNELS];
     for (int i = 0; i < N_MEM_CHANNELS; i++)
       mems[i] = mm[i]->get_data();
-    load_mem(mems, loadmem, CACHE_BLOCK_BYTES, N_MEM_CHANNELS);
+    load_mem(mems, loadmem, CACHE_BLOCK_BYTES, N_MEM_CHANNELS, MEM_BASE, mm[0]->get_size());
   }
 
   vcs_main(argc, argv);
   abort(); // should never get here
 }
 
+// What memory_tick last drove onto each channel.  DirectC output regs
+// hold their value between calls, so only outputs that change are written
+// back; r_data and w_data stay in their buffers (in vec32 layout, control
+// bits already clear, for r_data) from one cycle to the next.
+struct channel_ports_t
+{
+  bool driven;
+  bool ar_ready, aw_ready, w_ready, b_valid, r_valid, r_last;
+  uint64_t b_resp, b_id, r_resp, r_id;
+  std::vector<vec32> r_data;
+  std::vector<uint32_t> w_data;
+};
+static channel_ports_t ports[N_MEM_CHANNELS];
+
+static void put_scalar(vc_handle h, bool val, bool* last, bool force)
+{
+  if (force || val != *last)
+    vc_putScalar(h, val);
+  *last = val;
+}
+
+static void put_word(vc_handle h, uint64_t val, uint64_t* last, bool force, bool vector)
+{
+  if (force || val != *last)
+  {
+    if (vector)
+    {
+      vec32 d = {0, uint32_t(val)};
+      vc_put4stVector(h, &d);
+    }
+    else
+      vc_putScalar(h, val);
+  }
+  *last = val;
+}
+
 void memory_tick(
   vc_handle channel,
 
@@ -96,80 +150,93 @@ void memory_tick(
   int c = vc_4stVectorRef(channel)->d;
   assert(c < N_MEM_CHANNELS);
   mm_t* mmc = mm[c];
+  channel_ports_t& o = ports[c];
+  size_t words = mmc->get_word_size()/sizeof(uint32_t);
+
+  bool force = !o.driven;
+  if (force)
+  {
+    vec32 zero = {0, 0};
+    o.r_data.assign(words, zero);
+    o.w_data.resize(words);
+    o.driven = true;
+  }
 
-  uint32_t write_data[mmc->get_word_size()/sizeof(uint32_t)];
-  for (size_t i = 0; i < mmc->get_word_size()/sizeof(uint32_t); i++)
-    write_data[i] = vc_4stVectorRef(w_data)[i].d;
+  bool ar_v = vc_getScalar(ar_valid);
+  bool aw_v = vc_getScalar(aw_valid);
+  bool w_v = vc_getScalar(w_valid);
 
-  uint32_t aw_id_val, ar_id_val;
+  // With no request and nothing queued for the target, the outputs can't
+  // change, so there is nothing to marshal either way
+  if (!force && !ar_v && !aw_v && !w_v && mmc->idle_tick())
+    return;
 
+  if (w_v)
+  {
+    vec32* w = vc_4stVectorRef(w_data);
+    for (size_t i = 0; i < words; i++)
+      o.w_data[i] = w[i].d;
+  }
+
+  uint32_t aw_id_val = 0, ar_id_val = 0;
   if (MEM_ID_BITS == 1) {
     aw_id_val = vc_getScalar(aw_id);
     ar_id_val = vc_getScalar(ar_id);
   } else {
-    aw_id_val = vc_4stVectorRef(aw_id)->d;
-    ar_id_val = vc_4stVectorRef(ar_id)->d;
+    if (aw_v)
+      aw_id_val = vc_4stVectorRef(aw_id)->d;
+    if (ar_v)
+      ar_id_val = vc_4stVectorRef(ar_id)->d;
   }
 
+  bool r_rdy = vc_getScalar(r_ready);
+  bool r_fire = o.r_valid && r_rdy;
+
   mmc->tick
   (
-    vc_getScalar(ar_valid),
-    vc_4stVectorRef(ar_addr)->d - MEM_BASE,
+    ar_v,
+    ar_v ? vc_4stVectorRef(ar_addr)->d - MEM_BASE : 0,
     ar_id_val,
-    vc_4stVectorRef(ar_size)->d,
-    vc_4stVectorRef(ar_len)->d,
+    ar_v ? vc_4stVectorRef(ar_size)->d : 0,
+    ar_v ? vc_4stVectorRef(ar_len)->d : 0,
 
-    vc_getScalar(aw_valid),
-    vc_4stVectorRef(aw_addr)->d - MEM_BASE,
+    aw_v,
+    aw_v ? vc_4stVectorRef(aw_addr)->d - MEM_BASE : 0,
     aw_id_val,
-    vc_4stVectorRef(aw_size)->d,
-    vc_4stVectorRef(aw_len)->d,
+    aw_v ? vc_4stVectorRef(aw_size)->d : 0,
+    aw_v ? vc_4stVectorRef(aw_len)->d : 0,
 
-    vc_getScalar(w_valid),
-    vc_4stVectorRef(w_strb)->d,
-    write_data,
-    vc_getScalar(w_last),
+    w_v,
+    w_v ? vc_4stVectorRef(w_strb)->d : 0,
+    &o.w_data[0],
+    w_v && vc_getScalar(w_last),
 
-    vc_getScalar(r_ready),
+    r_rdy,
     vc_getScalar(b_ready)
   );
 
-  vc_putScalar(ar_ready, mmc->ar_ready());
-  vc_putScalar(aw_ready, mmc->aw_ready());
-  vc_putScalar(w_ready, mmc->w_ready());
-  vc_putScalar(b_valid, mmc->b_valid());
-  vc_putScalar(r_valid, mmc->r_valid());
-  vc_putScalar(r_last, mmc->r_last());
-
-  vec32 d[mmc->get_word_size()/sizeof(uint32_t)];
-
-  d[0].c = 0;
-  d[0].d = mmc->b_resp();
-  vc_put4stVector(b_resp, d);
-
-  d[0].c = 0;
-  d[0].d = mmc->r_resp();
-  vc_put4stVector(r_resp, d);
-
-  if (MEM_ID_BITS > 1) {
-    d[0].c = 0;
-    d[0].d = mmc->b_id();
-    vc_put4stVector(b_id, d);
-
-    d[0].c = 0;
-    d[0].d = mmc->r_id();
-    vc_put4stVector(r_id, d);
-  } else {
-    vc_putScalar(b_id, mmc->b_id());
-    vc_putScalar(r_id, mmc->r_id());
-  }
-
-  for (size_t i = 0; i < mmc->get_word_size()/sizeof(uint32_t); i++)
+  // A new read beat is up if there was none before or the last one was
+  // taken; otherwise r_data still holds it
+  bool r_v = mmc->r_valid();
+  if (force || (r_v && (!o.r_valid || r_fire)))
   {
-    d[i].c = 0;
-    d[i].d = ((uint32_t*)mmc->r_data())[i];
+    const uint32_t* r = (const uint32_t*)mmc->r_data();
+    for (size_t i = 0; i < words; i++)
+      o.r_data[i].d = r[i];
+    vc_put4stVector(r_data, &o.r_data[0]);
   }
-  vc_put4stVector(r_data, d);
+
+  put_scalar(ar_ready, mmc->ar_ready(), &o.ar_ready, force);
+  put_scalar(aw_ready, mmc->aw_ready(), &o.aw_ready, force);
+  put_scalar(w_ready, mmc->w_ready(), &o.w_ready, force);
+  put_scalar(b_valid, mmc->b_valid(), &o.b_valid, force);
+  put_scalar(r_valid, r_v, &o.r_valid, force);
+  put_scalar(r_last, mmc->r_last(), &o.r_last, force);
+
+  put_word(b_resp, mmc->b_resp(), &o.b_resp, force, true);
+  put_word(r_resp, mmc->r_resp(), &o.r_resp, force, true);
+  put_word(b_id, mmc->b_id(), &o.b_id, force, MEM_ID_BITS > 1);
+  put_word(r_id, mmc->r_id(), &o.r_id, force, MEM_ID_BITS > 1);
 }
 
 void htif_tick
@@ -0,0 +1,82 @@
+// See LICENSE for license details.
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <sched.h>
+
+// Runs fn(0) .. fn(n-1) once per round, fn(1) .. fn(n-1) each on its own
+// worker thread.  The caller starts a round with start(), runs fn(0) (and
+// anything else that doesn't touch the workers' state) itself, then calls
+// wait().  Workers spin between rounds, since rounds are only a cycle
+// apart, and fall back to yielding if the host is oversubscribed.
+class worker_pool_t
+{
+ public:
+  worker_pool_t(int n, std::function<void(int)> fn)
+    : fn(fn), round(0), done(0), stopping(false)
+  {
+    for (int i = 1; i < n; i++)
+      workers.push_back(std::thread(&worker_pool_t::worker, this, i));
+  }
+
+  ~worker_pool_t()
+  {
+    stopping.store(true, std::memory_order_relaxed);
+    round.fetch_add(1, std::memory_order_release);
+    for (auto& t: workers)
+      t.join();
+  }
+
+  void start()
+  {
+    done.store(0, std::memory_order_relaxed);
+    round.fetch_add(1, std::memory_order_release);
+  }
+
+  void wait()
+  {
+    for (int spins = 0; done.load(std::memory_order_acquire) != workers.size(); )
+      backoff(&spins);
+  }
+
+ private:
+  static const int spin_limit = 10000;
+
+  // Spins for the first spin_limit polls of a wait, then yields.  The count
+  // stops at the limit, so a long wait can't overflow it.
+  static void backoff(int* spins)
+  {
+    if (*spins < spin_limit)
+      ++*spins;
+    else
+      sched_yield();
+  }
+
+  void worker(int i)
+  {
+    uint64_t seen = 0;
+    while (true)
+    {
+      for (int spins = 0; round.load(std::memory_order_acquire) == seen; )
+        backoff(&spins);
+      seen++;
+      if (stopping.load(std::memory_order_relaxed))
+        return;
+      fn(i);
+      done.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  std::function<void(int)> fn;
+  std::vector<std::thread> workers;
+  std::atomic<uint64_t> round;
+  std::atomic<size_t> done;
+  std::atomic<bool> stopping;
+};
+
+#endif